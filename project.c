@@ -13,50 +13,186 @@
 int main(int argc, char *argv[]) {
 
     int lang_pt = 0;
-    
-    if (argc == 2 && strcmp(argv[1], "pt") == 0) {
-        lang_pt = 1;
+    int max_batches = MAX_VACCINES;
+    int report_stats = 0;
+    int pipelined = 0;
+    int reader_count = 0;
+    int site_workers = 0;
+    const char *restore_path = NULL;
+    const char *journal_path = NULL;
+    const char *listen_address = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "pt") == 0) {
+            lang_pt = 1;
+        } else if (strncmp(argv[i], MAX_BATCHES_OPTION, strlen(MAX_BATCHES_OPTION)) == 0) {
+            max_batches = atoi(argv[i] + strlen(MAX_BATCHES_OPTION)); // 0 for no limit
+        } else if (strcmp(argv[i], STATS_OPTION) == 0) {
+            report_stats = 1;
+        } else if (strncmp(argv[i], RESTORE_OPTION, strlen(RESTORE_OPTION)) == 0) {
+            restore_path = argv[i] + strlen(RESTORE_OPTION);
+        } else if (strncmp(argv[i], JOURNAL_OPTION, strlen(JOURNAL_OPTION)) == 0) {
+            journal_path = argv[i] + strlen(JOURNAL_OPTION);
+        } else if (strcmp(argv[i], PIPELINE_OPTION) == 0) {
+            pipelined = 1;
+        } else if (strncmp(argv[i], READERS_OPTION, strlen(READERS_OPTION)) == 0) {
+            reader_count = atoi(argv[i] + strlen(READERS_OPTION));
+            if (reader_count < 0) reader_count = 0;
+            if (reader_count > MAX_READERS) reader_count = MAX_READERS;
+            if (reader_count > 0) pipelined = 1;
+        } else if (strncmp(argv[i], LISTEN_OPTION, strlen(LISTEN_OPTION)) == 0) {
+            listen_address = argv[i] + strlen(LISTEN_OPTION);
+        } else if (strncmp(argv[i], SITES_OPTION, strlen(SITES_OPTION)) == 0) {
+            site_workers = atoi(argv[i] + strlen(SITES_OPTION));
+            if (site_workers < 0) site_workers = 0;
+            if (site_workers > MAX_SITE_WORKERS) site_workers = MAX_SITE_WORKERS;
+        }
+    }
+
+    /* Each site has a system of its own, which none of these apply to */
+    if (site_workers > 0 && (restore_path || journal_path || pipelined || listen_address)) {
+        fprintf(stderr, "%s: %s\n", SITES_OPTION, lang_pt ? ESITESOPTIONPT : ESITESOPTION);
+        return 1;
     }
 
-    char buf[MAX_LINE_LENGTH];
+    InputReader reader;
+    Command command;
+    long long journal_offset = 0; // Journal bytes already in the snapshot
 
     VaccineSystem system;
-    system.batch_count = 0;
-    system.current_date = (Date){1, 1, 2025}; // Initial system date
-    system.inoculations = NULL;
+    if (!init_vaccine_system(&system, stdout, max_batches) ||
+        !init_input_reader(&reader, stdin, &system.output)) {
+        puts("Memory allocation error");
+        return 1;
+    }
 
-    log_message("Vaccine system initialized.");
+    TRACE("Vaccine system initialized.");
 
-    while (fgets(buf, MAX_LINE_LENGTH, stdin)) {
-        switch (buf[0]) {
-            case 'c':
-                c(&system, buf, lang_pt);
-                break;
-            case 'l':
-                l(&system, buf, lang_pt);
-                break;
-            case 'a':
-                a(&system, buf, lang_pt);
-                break;
-            case 'r':
-                r(&system, buf, lang_pt);
-                break;
-            case 'd':
-                d(&system, buf, lang_pt);
-                break;
-            case 'u':
-                u(&system, buf, lang_pt);
-                break;
-            case 't':
-                t(&system, buf, lang_pt);
-                break;
-            case 'q':
-                q(&system);
-                break;
-            default:
+    /* Start from a snapshot instead of an empty system, then keep reading commands */
+    if (restore_path != NULL && !load_snapshot(&system, restore_path, &journal_offset)) {
+        fprintf(stderr, "%s: %s\n", restore_path, lang_pt ? ERESTOREPT : ERESTORE);
+        return 1;
+    }
+
+    /* Replay what the journal holds past the snapshot, then keep appending to it */
+    if (journal_path != NULL) {
+        long long journal_end = replay_journal(&system, journal_path, journal_offset);
+        if (journal_end == -1 || !open_journal(&system.journal, journal_path, journal_end)) {
+            fprintf(stderr, "%s: %s\n", journal_path, lang_pt ? EJOURNALPT : EJOURNAL);
+            return 1;
+        }
+        reader.journal = &system.journal;
+        system.output.journal = &system.journal;
+    }
+
+    int quit = 0;
+    if (listen_address != NULL) {
+        /* Clients send the same commands over sockets, all against this one system */
+        if (!serve(&system, &reader, listen_address, lang_pt)) {
+            fprintf(stderr, "%s: %s\n", listen_address, lang_pt ? ELISTENPT : ELISTEN);
+            return 1;
+        }
+        quit = 1;
+    } else if (pipelined) {
+        /* Same commands in the same order, parsed and written out on threads of their own */
+        Pipeline pipeline;
+        if (!start_pipeline(&pipeline, &system, &reader, reader_count)) {
+            puts("Memory allocation error");
+            return 1;
+        }
+        quit = execute_batches(&pipeline, &system, lang_pt);
+        stop_pipeline(&pipeline, &system);
+    } else if (site_workers > 0) {
+        /* Every site runs its own commands in order, sites side by side on the workers */
+        Sites sites;
+        if (!start_sites(&sites, site_workers, max_batches, lang_pt)) {
+            puts("Memory allocation error");
+            return 1;
+        }
+        quit = run_sites(&sites, &reader, &system.output);
+        stop_sites(&sites, report_stats && quit);
+        report_stats = 0; // The system here ran no command
+    } else {
+        /* Every line is tokenized once; handlers get its arguments already split */
+        while (read_command(&reader, &command)) {
+            if (command.error != NULL) {
+                write_line(&system.output, command.error);
+            }
+            if (command.name == 'q') {
+                quit = 1;
                 break;
+            }
+            run_command(&system, &command, lang_pt);
         }
     }
+
+    if (quit) {
+        if (report_stats) report_stats_on_exit(&system);
+        q(&system);
+    } else {
+        flush_output(&system.output);
+        close_journal(&system.journal);
+    }
+    free_input_reader(&reader);
+    return 0;
+}
+
+/* Runs a tokenized command other than q, timing it for the stats */
+void run_command(VaccineSystem *system, Command *command, int lang_pt) {
+    CommandStats *command_stats = find_command_stats(&system->stats, command->name);
+    long start = start_timing(command_stats);
+
+    switch (command->name) {
+        case 'c':
+            c(system, command, lang_pt);
+            break;
+        case 'l':
+            l(system, command, lang_pt);
+            break;
+        case 'a':
+            a(system, command, lang_pt);
+            break;
+        case 'r':
+            r(system, command, lang_pt);
+            break;
+        case 'd':
+            d(system, command, lang_pt);
+            break;
+        case 'u':
+            u(system, command, lang_pt);
+            break;
+        case 't':
+            t(system, command, lang_pt);
+            break;
+        case 's':
+            print_stats(&system->stats, system, &system->output);
+            break;
+        case 'w':
+            w(system, command, lang_pt);
+            break;
+        case 'e':
+            e(system, command, lang_pt);
+            break;
+        default:
+            return;
+    }
+    record_command(command_stats, start);
+}
+
+/* An empty system dated 01-01-2025, writing its output to the stream (NULL to discard it) */
+int init_vaccine_system(VaccineSystem *system, FILE *stream, int max_batches) {
+    system->current_date = make_date(1, 1, 2025); // Initial system date
+    system->log = (InoculationLog){NULL, 0, 0, 0, 0};
+    system->expired = (ExpiredBatches){NULL, 0, 0};
+    system->journal = (Journal){-1, NULL, 0, 0, 0, 0, 0};
+    system->deletions = 0;
+    system->readers = NULL;
+    memset(&system->stats, 0, sizeof(Stats));
+
+    return init_output_buffer(&system->output, stream) &&
+           init_batch_store(&system->store, max_batches) &&
+           init_intern_table(&system->patients, sizeof(Patient)) &&
+           init_intern_table(&system->vaccines, sizeof(Vaccine));
 }
 
 /*=================================== VACCINATION SYSTEM FUNCTIONS ===================================*/
@@ -65,145 +201,131 @@ int main(int argc, char *argv[]) {
  * Add a new vaccine batch to the system
  * Entry format: c <batch> <day>-<month>-<year> <number_of_doses> <vaccine_name>
  */
-void c(VaccineSystem *system, char *line, int lang_pt) {
-    log_message("Adding new vaccine batch.");
+void c(VaccineSystem *system, Command *command, int lang_pt) {
+    TRACE("Adding new vaccine batch.");
     
-    if (system->batch_count >= MAX_VACCINES) {
-        puts(lang_pt ? ETOOMANYPT : ETOOMANY);
+    if (batch_store_full(&system->store)) {
+        write_line(&system->output, lang_pt ? ETOOMANYPT : ETOOMANY);
         return;
     }
 
-    char batch[MAX_BATCH_LENGTH + 1], name[MAX_NAME_LENGTH + 1];
-    int day, month, year, doses;
+    char *name = command->args[1].text;
+    int day = command->day, month = command->month, year = command->year;
+    int doses = command->quantity;
 
-    sscanf(line + 2, "%s %d-%d-%d %d %s", batch, &day, &month, &year, &doses, name);
+    /* Only a well-formed batch number has a key, so it can only then be a duplicate */
+    VaccineBatch new_batch;
+    int valid_batch = parse_batch_key(command->args[0].text, command->args[0].length, &new_batch.batch);
 
     /* Check for duplicate batch number */
-    if (search_batch(system, batch) != -1) {
-        puts(lang_pt ? EDUPBATCHPT : EDUPBATCH);
+    if (valid_batch && search_batch(system, new_batch.batch) != -1) {
+        write_line(&system->output, lang_pt ? EDUPBATCHPT : EDUPBATCH);
         return;
     }
-    log_message("Batch number is unique.");
+    TRACE("Batch number is unique.");
 
     /* Validate batch format */
-    if (!is_valid_batch(batch)) {
-        puts(lang_pt ? EINVBATCHPT : EINVBATCH);
+    if (!valid_batch) {
+        write_line(&system->output, lang_pt ? EINVBATCHPT : EINVBATCH);
         return;
     }
-    log_message("Batch format is valid.");
+    TRACE("Batch format is valid.");
 
     /* Validate name format */
     if (!valid_vaccine_name(name)) {
-        puts(lang_pt ? EINVNAMEPT : EINVNAME);
+        write_line(&system->output, lang_pt ? EINVNAMEPT : EINVNAME);
         return;
     }
-    log_message("Vaccine name is valid.");
+    TRACE("Vaccine name is valid.");
 
     /* Validate expiration date */
     if (!is_valid_date(day, month, year)) {
-        puts(lang_pt ? EINVDATEPT : EINVDATE);
+        write_line(&system->output, lang_pt ? EINVDATEPT : EINVDATE);
         return;
     }
 
     /* Validate expiration date */
-    if (year < system->current_date.year ||
-        (year == system->current_date.year && month < system->current_date.month) ||
-        (year == system->current_date.year && month == system->current_date.month && day < system->current_date.day)) {
-        puts(lang_pt ? EINVDATEPT : EINVDATE);
+    Date expiration = make_date(day, month, year);
+    if (is_before_system_date(system, expiration)) {
+        write_line(&system->output, lang_pt ? EINVDATEPT : EINVDATE);
         return;
     }
 
     /* Validate dose quantity */
     if (doses <= 0) {
-        puts(lang_pt ? EINVQUANTITYPT : EINVQUANTITY);
+        write_line(&system->output, lang_pt ? EINVQUANTITYPT : EINVQUANTITY);
         return;
     }
 
-    VaccineBatch new_batch;
-    strncpy(new_batch.batch, batch, MAX_BATCH_LENGTH);
-    new_batch.batch[MAX_BATCH_LENGTH] = '\0';
-
-    strncpy(new_batch.name, name, MAX_NAME_LENGTH);
-    new_batch.name[MAX_NAME_LENGTH] = '\0';
-
-    new_batch.expiration = (Date){day, month, year};
+    new_batch.expiration = expiration;
     new_batch.available_doses = doses;
     new_batch.applied_doses = 0;
 
-    insert_sorted(system, new_batch); // To avoid sorting the array every time we call l
+    /* Intern the vaccine's name and make room in its heap, store the batch in order, then push it */
+    new_batch.vaccine = intern_name(&system->vaccines, name);
+    if (new_batch.vaccine == -1 || !reserve_vaccine_heap(get_vaccine(system, new_batch.vaccine)) ||
+        insert_sorted(system, &new_batch) == -1) {
+        write_line(&system->output, "Memory allocation error");
+        TRACE("Error: Memory allocation for new batch failed.");
+        return;
+    }
+    push_vaccine_batch(system, &new_batch); // Cannot fail, its room is reserved
 
-    printf("%s\n", new_batch.batch);
-    log_message("New batch successfully added.");
+    write_batch_key(&system->output, new_batch.batch);
+    write_char(&system->output, '\n');
+    TRACE("New batch successfully added.");
 }
 
 /**
  * List all vaccine batches or specific vaccines
  * Entry format: l [ <vaccine_name> { <vaccine_name> } ]
  */
-void l(VaccineSystem *system, char *line, int lang_pt) {
-    log_message("Listing vaccine batches.");
+void l(VaccineSystem *system, Command *command, int lang_pt) {
+    TRACE("Listing vaccine batches.");
 
-    char vaccine_names[MAX_LINE_LENGTH + 1];
     int found_any = 0;  // Tracks if at least one valid vaccine was found
 
-    if (sscanf(line, "l %[^\n]", vaccine_names) != 1) {
-        log_message("No vaccine name provided, listing all vaccine batches.");
+    /* A reader thread lists all the batches as they are now, while the next commands run */
+    if (system->readers != NULL && command->argc == 0 && start_read(system, command, lang_pt)) return;
+
+    if (command->argc == 0) {
+        TRACE("No vaccine name provided, listing all vaccine batches.");
         // No filters provided, list all batches
-        for (int i = 0; i < system->batch_count; i++) { 
-            VaccineBatch *batch = &system->batches[i];
-            printf("%s %s %02d-%02d-%04d %d %d\n",
-                   batch->name, batch->batch,
-                   batch->expiration.day, batch->expiration.month, batch->expiration.year,
-                   batch->available_doses, batch->applied_doses);
+        for (int i = 0; i < system->store.count; i++) { 
+            VaccineBatch batch = load_batch(&system->store, system->store.order[i]);
+            print_batch(&system->output, system->vaccines.names, &batch);
         }
         return;
     }
 
-    // Log the requested vaccine names
-    char log_buffer[MAX_LINE_LENGTH + 50];
-    snprintf(log_buffer, sizeof(log_buffer), "Filtering for vaccines: %s", vaccine_names);
-    log_message(log_buffer);
-
-    // Create a copy to avoid modifying the original input
-    char vaccine_names_copy[MAX_LINE_LENGTH + 1];
-    strncpy(vaccine_names_copy, vaccine_names, MAX_LINE_LENGTH);
-    vaccine_names_copy[MAX_LINE_LENGTH] = '\0';
-
-    // Tokenize vaccine_names (splits by space)
-    char *token = strtok(vaccine_names_copy, " ");
-    while (token != NULL) {
-        log_message("Processing vaccine name...");
-        snprintf(log_buffer, sizeof(log_buffer), "Looking for vaccine: %s", token);
-        log_message(log_buffer);
-
-        int found = 0;  // Tracks if the current vaccine was found
-
-        // Check for each batch
-        for (int i = 0; i < system->batch_count; i++) {
-            VaccineBatch *batch = &system->batches[i];
-            if (strcmp(system->batches[i].name, token) == 0) {
-                snprintf(log_buffer, sizeof(log_buffer), "Vaccine found: %s", token);
-                log_message(log_buffer);
-                printf("%s %s %02d-%02d-%04d %d %d\n",
-                       batch->name, batch->batch,
-                       batch->expiration.day, batch->expiration.month, batch->expiration.year,
-                       batch->available_doses, batch->applied_doses);
-                found = 1;
-                found_any = 1;
-            }
+    // The vaccine names were already split by spaces
+    for (int k = 0; k < command->argc; k++) {
+        char *token = command->args[k].text;
+        TRACE("Processing vaccine name...");
+
+        // Each vaccine keeps its own live batches in list order
+        Vaccine *vaccine = find_vaccine(system, token);
+        int found = vaccine != NULL ? vaccine->batch_count : 0;
+        record_scan(&system->stats.batch_scans, found);
+
+        for (int i = 0; i < found; i++) {
+            VaccineBatch batch = load_batch(&system->store, vaccine->batches[i]);
+            print_batch(&system->output, system->vaccines.names, &batch);
+        }
+        if (found) {
+            TRACE("Vaccine found.");
+            found_any = 1;
         }
 
         // If the vaccine was not found, print an error
         if (!found) {
-            printf("%s: %s\n", token, lang_pt ? ENOSUCHVACCINEPT : ENOSUCHVACCINE);
+            write_error(&system->output, token, lang_pt ? ENOSUCHVACCINEPT : ENOSUCHVACCINE);
         }
-
-        token = strtok(NULL, " ");  // Move to the next vaccine name
     }
 
     // If no valid vaccines were found at all, log a message
     if (!found_any) {
-        log_message("No matching vaccines found.");
+        TRACE("No matching vaccines found.");
     }
 }
 
@@ -211,111 +333,96 @@ void l(VaccineSystem *system, char *line, int lang_pt) {
  * Apply a vaccine dose to a patient
  * Entry format: a <patient_name> <vaccine_name>
  */
-void a(VaccineSystem *system, char *line, int lang_pt) {
-    log_message("Applying vaccine dose.");
-
-    char *patient_name = NULL;
-    char vaccine_name[MAX_VACCINE_LENGTH] = {0};
-    char *remainder = NULL;
+void a(VaccineSystem *system, Command *command, int lang_pt) {
+    TRACE("Applying vaccine dose.");
 
-    // Extarct the patient name and get a pointer for the rest of the line
-    if (!parse_patient_name(line, &patient_name, &remainder)) return;
+    // The patient name could not be read (error already reported)
+    if (command->argc == 0) return;
 
-    // Remainder is pointing to the beggining of the vaccine name
-    if (sscanf(remainder, "%s", vaccine_name) != 1) {
-        puts("Error: Missing vaccine name.");
-        free(patient_name);
+    if (command->argc < 2) {
+        write_line(&system->output, "Error: Missing vaccine name.");
         return;
     }
 
-    if (is_already_vaccinated(system, patient_name, vaccine_name)) {
-        puts(lang_pt ? EALREADYVACCINATEDPT : EALREADYVACCINATED);
-        log_message("Error: Patient has already been vaccinated with this vaccine today.");
-        free(patient_name);
+    char *patient_name = command->args[0].text;
+    char *vaccine_name = command->args[1].text;
+
+    /* The name is only borrowed from the input until a record has to keep it */
+    int patient_id = intern_lookup(&system->patients, patient_name);
+    int vaccine_id = intern_lookup(&system->vaccines, vaccine_name); // -1 if no batch ever had it
+    if (is_already_vaccinated(system, patient_id, vaccine_id)) {
+        write_line(&system->output, lang_pt ? EALREADYVACCINATEDPT : EALREADYVACCINATED);
+        TRACE("Error: Patient has already been vaccinated with this vaccine today.");
         return;   
     }
 
-    int best_batch_index = find_earliest_valid_batch(system, vaccine_name);
+    int best_batch_index = find_earliest_valid_batch(system, vaccine_id);
     if (best_batch_index == -1) {
-        puts(lang_pt ? ENOSTOCKPT : ENOSTOCK);
-        log_message("Error: No stock available.");
-        free(patient_name);
+        write_line(&system->output, lang_pt ? ENOSTOCKPT : ENOSTOCK);
+        TRACE("Error: No stock available.");
         return;
     }
 
     /* Select the best batch for vaccination based on earliest expiration date */
-    VaccineBatch *selected_batch = &system->batches[best_batch_index];
-    selected_batch->available_doses--;  // Decrease available doses
-    selected_batch->applied_doses++;    // Increase applied doses
-
-    /* Create a new inoculation record */
-    Inoculation *new_inoculation = (Inoculation *)malloc(sizeof(Inoculation));
-    if (!new_inoculation) {
-        puts("Memory allocation error");
-        log_message("Error: Memory allocation failed.");
-        free(patient_name);
-        return;
-    }
-
-    /* Allocate and store user name */
-    new_inoculation->user_name = strdup(patient_name);
-    if (!new_inoculation->user_name) {
-        free(new_inoculation);
-        free(patient_name);
-        puts("Memory allocation error");
-        log_message("Error: Memory allocation for user name failed.");
+    HotBatch *selected_batch = &system->store.hot[best_batch_index];
+
+    /* Records refer to the patient by the id of its interned name, copied in the arena the first time */
+    Inoculation new_inoculation;
+    new_inoculation.patient = patient_id != -1 ? patient_id : intern_name(&system->patients, patient_name);
+    new_inoculation.batch = system->store.keys[best_batch_index];
+    new_inoculation.vaccine = vaccine_id;
+    new_inoculation.application_date = system->current_date;
+    new_inoculation.deleted = 0;
+
+    if (new_inoculation.patient == -1 || !append_inoculation(system, &new_inoculation)) {
+        write_line(&system->output, "Memory allocation error");
+        TRACE("Error: Memory allocation failed.");
         return;
     }
 
-    /* Store batch identifier and application date */
-    strcpy(new_inoculation->batch, selected_batch->batch);
-    strcpy(new_inoculation->vaccine_name, vaccine_name);
-    new_inoculation->application_date = system->current_date;
-    new_inoculation->next = NULL;
-
-    insert_sorted_inoculation(system, new_inoculation);
+    selected_batch->available_doses--;  // Decrease available doses
+    selected_batch->applied_doses++;    // Increase applied doses
 
-    printf("%s\n", selected_batch->batch);
-    log_message("Vaccine dose applied successfully.");
-    free(patient_name);
+    write_batch_key(&system->output, system->store.keys[best_batch_index]);
+    write_char(&system->output, '\n');
+    TRACE("Vaccine dose applied successfully.");
 }
 
 /**
  * Removes availability of vaccine batch
  * Entry format: r <batch>
  */
-void r(VaccineSystem *system, char *line, int lang_pt) {
-    log_message("Removing vaccine batch availability...");
-    char batch[MAX_BATCH_LENGTH + 1];
+void r(VaccineSystem *system, Command *command, int lang_pt) {
+    TRACE("Removing vaccine batch availability...");
 
-    /* Extract the batch identifier from the input line */
-    if (sscanf(line, "r %20s", batch) != 1) {
-        puts(lang_pt ? EINVALIDPT : EINVALID);
-        log_message("Error: Invalid input format.");
+    /* The batch identifier is required */
+    if (command->argc == 0) {
+        write_line(&system->output, lang_pt ? EINVALIDPT : EINVALID);
+        TRACE("Error: Invalid input format.");
         return;
     }
 
     /* Search for the batch in the system */
-    int batch_index = search_batch(system, batch);
-    if (batch_index == -1){
-        printf("%s: %s\n", batch, lang_pt ? ENOSUCHBATCHPT : ENOSUCHBATCH);
-        log_message("Error: Batch not found.");
+    char *batch = command->args[0].text;
+    BatchKey key;
+    int batch_slot = parse_batch_key(batch, command->args[0].length, &key) ? search_batch(system, key) : -1;
+    if (batch_slot == -1){
+        write_error(&system->output, batch, lang_pt ? ENOSUCHBATCHPT : ENOSUCHBATCH);
+        TRACE("Error: Batch not found.");
         return;
     }
 
-    VaccineBatch *selected_batch = &system->batches[batch_index];
-    printf("%d\n", selected_batch->applied_doses);
+    HotBatch *selected_batch = &system->store.hot[batch_slot];
+    write_int(&system->output, selected_batch->applied_doses);
+    write_char(&system->output, '\n');
 
     /* If no doses have been applied, remove the batch entirely */
     if (selected_batch->applied_doses == 0){
-        log_message("No doses applied, removing batch from the system.");
-        for (int i = batch_index; i < system->batch_count - 1; i++){
-            system->batches[i] = system->batches[i + 1];
-        }
-        system->batch_count--;
+        TRACE("No doses applied, removing batch from the system.");
+        remove_batch(system, batch_slot);
     } else {
         /* If doses were applied, retain the batch but mark it as unavailable */
-        log_message("Doses applied, setting available doses to 0.");
+        TRACE("Doses applied, setting available doses to 0.");
         selected_batch->available_doses = 0;
     }
 }
@@ -324,117 +431,107 @@ void r(VaccineSystem *system, char *line, int lang_pt) {
  * Deletes inoculation record for a given patient
  * Entry format: d <patient_name> [ <vaccination_date> [ <batch> ] ]
  */
-void d(VaccineSystem *system, char *line, int lang_pt) {
-    log_message("Deleting application record...");
+void d(VaccineSystem *system, Command *command, int lang_pt) {
+    TRACE("Deleting application record...");
 
-    char *patient_name = NULL;
-    char batch[MAX_BATCH_LENGTH + 1] = {0};
-    char *remainder = NULL;
     int found = 0, deleted_count = 0;
-    int args_parsed, day = 0, month = 0, year = 0;
+    int has_date = command->date_fields == 3;
+    char *batch = command->argc == 2 ? command->args[1].text : NULL;
+    BatchKey key;
+    Date date = 0;
 
-    if (!parse_patient_name(line, &patient_name, &remainder)) return; 
+    // The patient name could not be read (error already reported)
+    if (command->argc == 0) return;
+    char *patient_name = command->args[0].text;
 
-    args_parsed = sscanf(remainder, "%d-%d-%d %20s", &day, &month, &year, batch);
-    
     // Validate the date if inserted
-    if (args_parsed >= 3 && !is_valid_date(day, month, year)) { 
-        puts(lang_pt ? EINVDATEPT : EINVDATE);
-        log_message("Error: Invalid date.");
-        free(patient_name);
+    if (has_date && !is_valid_date(command->day, command->month, command->year)) { 
+        write_line(&system->output, lang_pt ? EINVDATEPT : EINVDATE);
+        TRACE("Error: Invalid date.");
         return;
     }
+    if (has_date) date = make_date(command->day, command->month, command->year);
 
     // Validate the batch if inserted
-    if (args_parsed == 4 && !batch_exists(system, batch)) {
-        printf("%s: %s\n", batch, lang_pt ? ENOSUCHBATCHPT : ENOSUCHBATCH);
-        log_message("Error: Batch not found.");
-        free(patient_name);
+    if (batch != NULL && (!parse_batch_key(batch, command->args[1].length, &key) || search_batch(system, key) == -1)) {
+        write_error(&system->output, batch, lang_pt ? ENOSUCHBATCHPT : ENOSUCHBATCH);
+        TRACE("Error: Batch not found.");
         return;
     }
 
-    Inoculation *prev = NULL;
-    Inoculation *current = system->inoculations;
+    Patient *patient = find_patient(system, patient_name);
+    found = patient != NULL; // At least one inoculation of this patient exists
 
-    /* Iterate through the linked list to find and remove inoculations */
-    while (current != NULL) {
-        log_message("Checking inoculation record...");
-        Inoculation *next_inoculation = current->next; // Save the next pointer before deleting
+    /* Only this patient's records for the date, if any, are visited; the kept ones are packed in place */
+    if (patient != NULL) {
+        int first = 0, end = patient->count;
+        if (has_date) find_date_records(system, patient, date, &first, &end);
 
-        log_message("Comparing user name...");
-        if (strcmp(current->user_name, patient_name) == 0) {
-            found = 1; // Flag to indicate that at least one inoculation was found
-            log_message("Inoculation record found.");
+        int kept = first;
+        record_scan(&system->stats.record_scans, end - first);
+        for (int i = first; i < end; i++) {
+            TRACE("Checking inoculation record...");
+            Inoculation *current = log_record(&system->log, patient->records[i]);
 
-            if (match_filters(current, args_parsed, day, month, year, batch)) {
-                log_message("Inoculation record matches filters.");
-                remove_inoculation(system, &prev, &current);
+            if (match_filters(current, has_date, date, batch != NULL ? &key : NULL)) {
+                TRACE("Inoculation record matches filters.");
+                remove_inoculation(system, current);
                 deleted_count++;
-                current = next_inoculation;
-                continue;
+            } else {
+                patient->records[kept++] = patient->records[i];
             }
         }
-        prev = current;
-        current = next_inoculation; // Move to the next inoculation record
+        memmove(patient->records + kept, patient->records + end, (patient->count - end) * sizeof(int));
+        patient->count -= end - kept;
+        compact_inoculation_log(system);
     }
 
-    printf("%d\n", deleted_count);
+    write_int(&system->output, deleted_count);
+    write_char(&system->output, '\n');
 
     if (!found) {
-        printf("%s: %s\n", patient_name, lang_pt ? ENOSUCHUSERPT : ENOSUCHUSER);
-        log_message("Error: Patient not found.");
+        write_error(&system->output, patient_name, lang_pt ? ENOSUCHUSERPT : ENOSUCHUSER);
+        TRACE("Error: Patient not found.");
     } else {
-        log_message("Inoculation records deleted successfully.");
+        TRACE("Inoculation records deleted successfully.");
     }
-    free(patient_name);
 }
 
 /**
  * Lists all inoculations or inoculations for a specific user
  * Entry format: u [ <patient_name> ]
  */
-void u(VaccineSystem *system, char *line, int lang_pt) {
-    log_message("Listing vaccine applications...");
+void u(VaccineSystem *system, Command *command, int lang_pt) {
+    TRACE("Listing vaccine applications...");
 
-    char *patient_name = NULL;
-    char *remainder = NULL;
-    int has_filter = 0;
-    int found = 0;
+    // A patient name was given
+    int has_filter = command->argc == 1;
 
-    // Check if there is more arguments
-    if (strlen(line) > 2) {  
-        if (parse_patient_name(line, &patient_name, &remainder)) {
-            has_filter = 1; 
+    /* Without a filter, scan the whole log, skipping deleted records */
+    if (!has_filter) {
+        if (system->log.live == 0) {
+            TRACE("No recorded of inoculations in the system.");
         }
-    }
-
-    Inoculation *current = system->inoculations;
-
-    if (current == NULL) {
-        log_message("No recorded of inoculations in the system.");
-    }
-
-    /* Iterate through the linked list and print records */
-    while (current) {
-
-        /* If a filter is applied, check if the names match */
-        if (!has_filter || strcmp(current->user_name, patient_name) == 0) {
-            printf("%s %s %02d-%02d-%04d\n",
-                   current->user_name, current->batch,
-                   current->application_date.day,
-                   current->application_date.month,
-                   current->application_date.year);
-            found = 1;
+        if (system->readers != NULL && start_read(system, command, lang_pt)) return;
+        record_scan(&system->stats.record_scans, system->log.size);
+        for (int pos = 0; pos < system->log.size; pos++) {
+            Inoculation *current = log_record(&system->log, pos);
+            if (!current->deleted) print_inoculation(&system->output, system->patients.names, current);
         }
-
-        current = current->next;
+        return;
     }
 
-    /* If filtering by user and no inoculations were found, return an error */
-    if (has_filter && !found) {
-        printf("%s: %s\n", patient_name, lang_pt ? ENOSUCHUSERPT : ENOSUCHUSER);
-        free(patient_name);
-        log_message("Error: Patient not found.");
+    /* With a filter, only the patient's own records are visited */
+    char *patient_name = command->args[0].text;
+    Patient *patient = find_patient(system, patient_name);
+    if (patient == NULL) {
+        write_error(&system->output, patient_name, lang_pt ? ENOSUCHUSERPT : ENOSUCHUSER);
+        TRACE("Error: Patient not found.");
+    } else {
+        record_scan(&system->stats.record_scans, patient->count);
+        for (int i = 0; i < patient->count; i++) {
+            print_inoculation(&system->output, system->patients.names, log_record(&system->log, patient->records[i]));
+        }
     }
 }
 
@@ -442,64 +539,95 @@ void u(VaccineSystem *system, char *line, int lang_pt) {
  * Advances the simulated system date
  * Entry format: t [ <day>-<month>-<year> ]
  */
-void t(VaccineSystem *system, char *line, int lang_pt) {
-    int day, month, year;
+void t(VaccineSystem *system, Command *command, int lang_pt) {
+    int day = command->day, month = command->month, year = command->year;
 
     // Check if the user provided a new date
-    if (sscanf(line, "t %d-%d-%d", &day, &month, &year) == 3) {
-        log_message("Advancing system date...");
+    if (command->date_fields == 3) {
+        TRACE("Advancing system date...");
 
         // Validate that the new date is valid and in the future
         //if (!is_valid_date(day, month, year, system->current_date)) {
         if (!is_valid_date(day, month, year)) {   
-            puts(lang_pt ? EINVDATEPT : EINVDATE);
-            log_message("Error: Invalid date.");
+            write_line(&system->output, lang_pt ? EINVDATEPT : EINVDATE);
+            TRACE("Error: Invalid date.");
             return;
         }
         
         // Ensure the new date is not in the past
-        if (year < system->current_date.year ||
-            (year == system->current_date.year && month < system->current_date.month) ||
-            (year == system->current_date.year && month == system->current_date.month && day < system->current_date.day)) {
-            puts(lang_pt ? EINVDATEPT : EINVDATE);
-            log_message("Error: Date is in the past.");
+        Date date = make_date(day, month, year);
+        if (is_before_system_date(system, date)) {
+            write_line(&system->output, lang_pt ? EINVDATEPT : EINVDATE);
+            TRACE("Error: Date is in the past.");
             return;
         }
 
-        // Update the system date
-        system->current_date = (Date){day, month, year};
-        log_message("System date updated successfully.");
+        // Update the system date, retiring the batches it leaves expired; the same date keeps e's report
+        if (date != system->current_date) {
+            system->current_date = date;
+            expire_batches(system);
+        }
+        TRACE("System date updated successfully.");
     }
 
     // Print the current system date
-    printf("%02d-%02d-%04d\n", system->current_date.day, system->current_date.month, system->current_date.year);
+    write_date(&system->output, system->current_date);
+    write_char(&system->output, '\n');
 } 
 
-void q(VaccineSystem *system) {
-    log_message("Freeing allocated memory before termination");
+/**
+ * Writes a binary snapshot of the whole system, to be loaded with --restore
+ * Entry format: w <file>
+ */
+void w(VaccineSystem *system, Command *command, int lang_pt) {
+    TRACE("Writing snapshot...");
 
-    // Free the linked list of inoculations
-    Inoculation *current = system->inoculations;
-    while (current != NULL) {
-        Inoculation *next = current->next;
-        free(current->user_name);   // free dynamically allocated user_name
-        free(current);              // Free the inoculation structure
-        current = next;
+    if (command->argc == 0) {
+        write_line(&system->output, lang_pt ? EINVALIDPT : EINVALID);
+        return;
     }
 
-    log_message("All allocated memory has been freed. Terminating program.");
-    exit(0);
+    /* The snapshot covers every journaled command before it, already durable */
+    if (!save_snapshot(system, command->args[0].text, command->journal_offset)) {
+        write_error(&system->output, command->args[0].text, lang_pt ? ESNAPSHOTPT : ESNAPSHOT);
+        TRACE("Error: Snapshot not written.");
+    }
 }
 
-/*======================================= AUXILIARY FUNCTIONS =======================================*/
+/**
+ * Lists the batches that expired in the last date change, with the doses
+ * they still had and that were wasted
+ * Entry format: e
+ */
+void e(VaccineSystem *system, Command *command, int lang_pt) {
+    (void)command;
+    (void)lang_pt;
 
-/* Logging function */
-void log_message(const char *message) {
-    if (LOGGING_ENABLED) {
-        printf("[LOG] %s\n", message);
+    for (int i = 0; i < system->expired.count; i++) {
+        print_expired(&system->output, system->vaccines.names, &system->expired.batches[i]);
     }
 }
 
+void q(VaccineSystem *system) {
+    TRACE("Freeing allocated memory before termination");
+
+    // Inoculations are freed chunk by chunk, interned names too
+    free_inoculation_log(&system->log);
+    free_patient_records(system);
+    free_intern_table(&system->patients);
+    free_vaccines(&system->vaccines);
+    free_intern_table(&system->vaccines);
+    free_batch_store(&system->store);
+    free(system->expired.batches);
+    flush_output(&system->output);
+    free_output_buffer(&system->output);
+    close_journal(&system->journal);
+
+    TRACE("All allocated memory has been freed. Terminating program.");
+}
+
+/*======================================= AUXILIARY FUNCTIONS =======================================*/
+
 int valid_vaccine_name(const char *name) {
     int byte_count = 0;
 
@@ -518,266 +646,3148 @@ int valid_vaccine_name(const char *name) {
     return 1;  // Valid name
 }
 
+/* Searches for a batch in the system, returning its slot or -1 if not found */
+int search_batch(VaccineSystem *system, BatchKey batch) {
+    TRACE("Searching for batch in system.");
+    return system->store.index.buckets[batch_bucket(system, batch)];
+}
+
+/* Compares two batches to find the right position */
+int compare_batches(VaccineBatch *batch1, VaccineBatch *batch2) {
+    if (batch1->expiration != batch2->expiration)
+        return batch1->expiration < batch2->expiration ? -1 : 1;
+    return compare_batch_keys(batch1->batch, batch2->batch); // Ordem alfabética do lote
+}
+
 /**
- * Validates whether a batch name consists only of uppercase hexadecimal characters.
+ * Stores a new batch and inserts its slot in the ordered list and in its
+ * vaccine's, so l never has to sort. Only slot numbers are shifted; returns
+ * the slot or -1 on failure, leaving the store as it was. The vaccine must
+ * already be interned.
  */
-int is_valid_batch(const char *batch) {
-    int len = strlen(batch);
-    
-    if (len > MAX_BATCH_LENGTH) return 0; 
-    
-    for (int i = 0; i < len; i++) {
-        char c = batch[i];
-        
-        if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))) {
-            return 0;
-        }
+int insert_sorted(VaccineSystem *system, VaccineBatch *new_batch) {
+    BatchStore *store = &system->store;
+    Vaccine *vaccine = get_vaccine(system, new_batch->vaccine);
+    if (!reserve_vaccine_batch(vaccine)) return -1;
+
+    int slot = alloc_batch_slot(store);
+    if (slot == -1) return -1;
+
+    store_batch(store, slot, new_batch);
+    if (!index_batch(system, slot)) {
+        store->free_slots[store->free_count++] = slot;
+        return -1;
     }
 
-    return 1;  // Valid batch
+    int pos = order_position(system, slot);
+    memmove(&store->order[pos + 1], &store->order[pos], (store->count - pos) * sizeof(int));
+    store->order[pos] = slot;
+    store->count++;
+
+    pos = vaccine_position(system, vaccine, slot);
+    memmove(&vaccine->batches[pos + 1], &vaccine->batches[pos], (vaccine->batch_count - pos) * sizeof(int));
+    vaccine->batches[pos] = slot;
+    vaccine->batch_count++;
+
+    store->expiry_pos[slot] = -1;
+    if (!is_before_system_date(system, new_batch->expiration)) push_expiry(system, slot);
+    return slot;
 }
 
-/* Searches for a batch in the system */
-int search_batch(VaccineSystem *system, char *batch) {
-    log_message("Searching for batch in system.");
-    for (int i = 0; i < system->batch_count; i++) {
-        if (strcmp(system->batches[i].batch, batch) == 0) {
-            return i;  // Returns the index of the found batch
-            log_message("Batch found.");
-        }
-    }
-    log_message("Batch not found.");
-    return -1; // Returns -1 if not found
+/* Prints a single vaccine batch */
+void print_batch(OutputBuffer *out, char **vaccine_names, VaccineBatch *batch) {
+    write_string(out, vaccine_names[batch->vaccine]);
+    write_char(out, ' ');
+    write_batch_key(out, batch->batch);
+    write_char(out, ' ');
+    write_date(out, batch->expiration);
+    write_char(out, ' ');
+    write_int(out, batch->available_doses);
+    write_char(out, ' ');
+    write_int(out, batch->applied_doses);
+    write_char(out, '\n');
 }
 
-/* Compares two batches to find the right position */
-int compare_batches(VaccineBatch *batch1, VaccineBatch *batch2) {
-    if (batch1->expiration.year != batch2->expiration.year)
-        return batch1->expiration.year - batch2->expiration.year;
-    if (batch1->expiration.month != batch2->expiration.month)
-        return batch1->expiration.month - batch2->expiration.month;
-    if (batch1->expiration.day != batch2->expiration.day)
-        return batch1->expiration.day - batch2->expiration.day;
-    return strcmp(batch1->batch, batch2->batch); // Ordem alfabética do lote
-}
-
-/* Insert a new batch keeping the list soted */
-void insert_sorted(VaccineSystem *system, VaccineBatch new_batch) {
-    int i, pos = 0;
-
-    for (i = 0; i < system->batch_count; i++) {
-        if (compare_batches(&new_batch, &system->batches[i]) < 0) {
-            pos = i;
-            break;
-        }
-    }
-    if (i == system->batch_count) pos = system->batch_count; 
+/* Prints an expired batch for e, with the doses it still had */
+void print_expired(OutputBuffer *out, char **vaccine_names, VaccineBatch *batch) {
+    write_string(out, vaccine_names[batch->vaccine]);
+    write_char(out, ' ');
+    write_batch_key(out, batch->batch);
+    write_char(out, ' ');
+    write_date(out, batch->expiration);
+    write_char(out, ' ');
+    write_int(out, batch->available_doses);
+    write_char(out, '\n');
+}
 
-    for (i = system->batch_count; i > pos; i--) {
-        system->batches[i] = system->batches[i - 1];
+/**
+ * Finds the oldest batch, but only among those that are valid (not expired)
+ * and have available doses. The top of the vaccine's heap is the earliest
+ * candidate; entries that can no longer be dispensed are dropped lazily.
+ */
+int find_earliest_valid_batch(VaccineSystem *system, int vaccine_id) {
+    TRACE("Searching for the earliest valid vaccine batch.");
+    Vaccine *vaccine = vaccine_id != -1 ? get_vaccine(system, vaccine_id) : NULL;
+
+    while (vaccine != NULL && vaccine->heap_size > 0) {
+        int best_batch_index = dispensable_batch(system, vaccine_id, &vaccine->heap[0]);
+        if (best_batch_index != -1) {
+            TRACE("Found the earliest valid batch.");
+            return best_batch_index;
+        }
+        TRACE("Dropping batch that can no longer be dispensed.");
+        pop_vaccine_batch(vaccine);
     }
 
-    system->batches[pos] = new_batch;
-    system->batch_count++;
+    TRACE("No valid batch found.");
+    return -1;
 }
 
-int compare_inoculations(Inoculation *inoc1, Inoculation *inoc2) {
-    if (inoc1->application_date.year != inoc2->application_date.year)
-        return inoc1->application_date.year - inoc2->application_date.year;
-    if (inoc1->application_date.month != inoc2->application_date.month)
-        return inoc1->application_date.month - inoc2->application_date.month;
-    if (inoc1->application_date.day != inoc2->application_date.day)
-        return inoc1->application_date.day - inoc2->application_date.day;
+/**
+ * Validates a given date.
+ */
+int is_valid_date(int day, int month, int year) {
+    static const int days_in_month[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+    if (month < 1 || month > 12 || day < 1) return 0; 
+    if (year < -MAX_YEAR || year > MAX_YEAR) return 0; // Beyond the day number range
+
+    if (day > days_in_month[month - 1]) {
+        /* February has 29 days in leap years */
+        int leap = (year % 4 == 0 && year % 100 != 0) || (year % 400 == 0);
+        if (!(month == 2 && leap && day == 29)) return 0; // Invalid day
+    }
 
-    return -1; 
+    return 1; // Valid date
 }
 
-void insert_sorted_inoculation(VaccineSystem *system, Inoculation *new_inoculation) {
-    Inoculation **current = &system->inoculations; 
+/**
+ * Converts a valid date into its day number (days since 01-01-1970).
+ * Years are counted from March so that the leap day falls at their end.
+ */
+Date make_date(int day, int month, int year) {
+    /* Days from the 1st of March to the 1st of each month */
+    static const int days_before_month[12] = { 306, 337, 0, 31, 61, 92, 122, 153, 184, 214, 245, 275 };
+
+    year -= month <= 2;
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int year_of_era = year - era * 400;
+    int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 +
+                     days_before_month[month - 1] + day - 1;
+    return era * DAYS_PER_ERA + day_of_era - EPOCH_DAY_NUMBER;
+}
 
-    while (*current != NULL && compare_inoculations(*current, new_inoculation) < 0) {
-        current = &((*current)->next);
-    }
+/* Converts a day number back into day, month and year */
+void split_date(Date date, int *day, int *month, int *year) {
+    int days = date + EPOCH_DAY_NUMBER;
+    int era = (days >= 0 ? days : days - DAYS_PER_ERA + 1) / DAYS_PER_ERA;
+    int day_of_era = days - era * DAYS_PER_ERA;
+    int year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int march_month = (5 * day_of_year + 2) / 153; // 0 for March, 11 for February
+
+    *day = day_of_year - (153 * march_month + 2) / 5 + 1;
+    *month = march_month < 10 ? march_month + 3 : march_month - 9;
+    *year = year_of_era + era * 400 + (*month <= 2);
+}
 
-    new_inoculation->next = *current;
-    *current = new_inoculation;
+/* Whether a day number is that of a valid date, for dates read back from a snapshot */
+int is_valid_day_number(Date date) {
+    return date >= make_date(1, 1, -MAX_YEAR) && date <= make_date(31, 12, MAX_YEAR);
 }
 
-// Finds the oldest batch, but only among those that are valid (not expired) and have available doses
-int find_earliest_valid_batch(VaccineSystem *system, char *vaccine_name) {
-    log_message("Searching for the earliest valid vaccine batch.");
-    int best_batch_index = -1;
-    for (int i = 0; i < system->batch_count; i++) {
-        VaccineBatch *batch = &system->batches[i];
-        log_message("Checking batch");
+/* Checks whether a date is earlier than the current system date */
+int is_before_system_date(VaccineSystem *system, Date date) {
+    return date < system->current_date;
+}
 
-        if (strcmp(batch->name, vaccine_name) == 0) {
-            log_message("Matching vaccine found.");
+int is_already_vaccinated(VaccineSystem *system, int patient_id, int vaccine_id) {
+    Patient *patient = patient_id != -1 ? get_patient(system, patient_id) : NULL;
 
-            if (batch->available_doses > 0) {
-                log_message("Batch has available doses.");
+    /* The patient's records are sorted by date, so today's ones are at the end */
+    for (int i = patient ? patient->count - 1 : -1; i >= 0; i--) {
+        Inoculation *current = log_record(&system->log, patient->records[i]);
+        if (current->application_date != system->current_date) break;
+        if (current->vaccine == vaccine_id) {
+            return 1; // Patient already vaccinated on this day
+        }
+    }
 
-                if (batch->expiration.year > system->current_date.year ||
-                    (batch->expiration.year == system->current_date.year && batch->expiration.month > system->current_date.month) ||
-                    (batch->expiration.year == system->current_date.year && batch->expiration.month == system->current_date.month && 
-                    batch->expiration.day >= system->current_date.day)) {
-                    log_message("Batch is valid and not expired.");
+    return 0; // Patient hasnt been vaccinated today
+}
 
-                    if (best_batch_index == -1 || batch->expiration.year < system->batches[best_batch_index].expiration.year ||
-                        (batch->expiration.year == system->batches[best_batch_index].expiration.year && 
-                        batch->expiration.month < system->batches[best_batch_index].expiration.month) ||
-                        (batch->expiration.year == system->batches[best_batch_index].expiration.year && 
-                        batch->expiration.month == system->batches[best_batch_index].expiration.month && 
-                        batch->expiration.day < system->batches[best_batch_index].expiration.day)) {
-                        log_message("New best batch found.");
-                        best_batch_index = i;
-                    }
-                }
-            }
+/* Checks if the given inoculation matches the optional filters (date & batch, NULL if absent) */
+int match_filters(Inoculation *inoculation, int has_date, Date date, const BatchKey *batch) {
+    if (has_date) {
+        if (inoculation->application_date != date) {
+            TRACE("Skipping record: date does not match.");
+            return 0;  // Does not match
         }
+        TRACE("Date matches.");
     }
 
-    if (best_batch_index != -1) {
-        log_message("Found the earliest valid batch.");
-    } else {
-        log_message("No valid batch found.");
+    // if batch filter was provided
+    if (batch != NULL) {
+        if (!same_batch_key(inoculation->batch, *batch)) {
+            TRACE("Skipping record: batch does not match.");
+            return 0;  // Does not match
+        }
+        TRACE("Batch matches.");
     }
 
-    return best_batch_index;
+    return 1;  // All filters match
 }
 
 /**
- * Validates a given date.
+ * Marks a matched inoculation as deleted, stamped with the deletion's
+ * number for the readers still listing the log. The caller drops it from
+ * its patient's records; the log reclaims it on the next compaction.
  */
-//int is_valid_date(int day, int month, int year, Date system_date) {
-int is_valid_date(int day, int month, int year) {
-    if (month < 1 || month > 12 || day < 1) return 0; 
-    
-    int days_in_month[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
-    if ((year % 4 == 0 && year % 100 != 0) || (year % 400 == 0)) {
-        days_in_month[1] = 29;  // February has 29 days (Lap year)
+void remove_inoculation(VaccineSystem *sys, Inoculation *inoculation) {
+    atomic_store_explicit(&inoculation->deleted, ++sys->deletions, memory_order_relaxed);
+    sys->log.live--;
+}
+
+/* Prints a single inoculation record */
+void print_inoculation(OutputBuffer *out, char **patient_names, Inoculation *inoculation) {
+    write_string(out, patient_names[inoculation->patient]);
+    write_char(out, ' ');
+    write_batch_key(out, inoculation->batch);
+    write_char(out, ' ');
+    write_date(out, inoculation->application_date);
+    write_char(out, '\n');
+}
+
+/*=========================================== BATCH KEYS ===========================================*/
+
+/**
+ * Validates a batch identifier (at most MAX_BATCH_LENGTH uppercase hex
+ * digits) and packs it into a key, returning 0 if it is not one. The
+ * digits are padded with '0' to 32 bytes, so every digit position parses
+ * alike and the unused ones come out as zero.
+ */
+int parse_batch_key(const char *text, int length, BatchKey *key) {
+    if (length > MAX_BATCH_LENGTH) return 0;
+
+    unsigned char digits[32];
+    memset(digits, '0', sizeof(digits));
+    memcpy(digits, text, length);
+    unsigned char packed[16]; // Two digits per byte, the first in the high nibble
+
+#ifdef __SSE2__
+    /* Both halves at once: classify every byte, turn it into its value, then pair the values up */
+    __m128i halves[2] = { _mm_loadu_si128((const __m128i *)digits), _mm_loadu_si128((const __m128i *)(digits + 16)) };
+    int valid = 1;
+    for (int i = 0; i < 2; i++) {
+        __m128i c = halves[i];
+        __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+        __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('F' + 1)));
+        valid &= _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) == 0xFFFF;
+
+        __m128i value = _mm_sub_epi8(_mm_sub_epi8(c, _mm_set1_epi8('0')), _mm_and_si128(is_letter, _mm_set1_epi8('A' - '9' - 1)));
+        halves[i] = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(value, 4), _mm_set1_epi16(0x00F0)), _mm_srli_epi16(value, 8));
     }
-    
-    if (day > days_in_month[month - 1]) return 0; // Invalid day
+    if (!valid) return 0;
+    _mm_storeu_si128((__m128i *)packed, _mm_packus_epi16(halves[0], halves[1]));
+#else
+    for (int i = 0; i < MAX_BATCH_LENGTH; i++) {
+        unsigned char c = digits[i];
+        int value = c >= '0' && c <= '9' ? c - '0' : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (value < 0) return 0;
+        packed[i / 2] = i % 2 == 0 ? value << 4 : packed[i / 2] | value;
+    }
+#endif
 
-    return 1; // Valid date
+    key->head = 0;
+    for (int i = 0; i < BATCH_KEY_HEAD_DIGITS / 2; i++) {
+        key->head = key->head << 8 | packed[i];
+    }
+    key->tail = (unsigned int)packed[8] << 16 | (unsigned int)packed[9] << 8 | length;
+    return 1;
+}
+
+/* Whether parse_batch_key could have made the key: digits past the length were padded with zeros */
+int is_valid_batch_key(BatchKey key) {
+    int length = key.tail & 0xFF;
+    if (length < 1 || length > MAX_BATCH_LENGTH || key.tail >> 24 != 0) return 0;
+
+    unsigned int tail_digits = key.tail >> 8 & 0xFFFF;
+    if (length <= BATCH_KEY_HEAD_DIGITS) {
+        return tail_digits == 0 && (length == BATCH_KEY_HEAD_DIGITS || key.head << 4 * length == 0);
+    }
+    return (tail_digits & ((1u << 4 * (MAX_BATCH_LENGTH - length)) - 1)) == 0;
 }
 
-int is_before_system_date(VaccineSystem *system, int day, int month, int year) {
-    Date sys = system->current_date;
+/* Orders keys like strcmp orders their identifiers, without branching */
+int compare_batch_keys(BatchKey key1, BatchKey key2) {
+    int head = (key1.head > key2.head) - (key1.head < key2.head);
+    int tail = (key1.tail > key2.tail) - (key1.tail < key2.tail);
+    return 2 * head + tail;
+}
 
-    if (year < sys.year) return 0;
-    if (year == sys.year && month < sys.month) return 0;
-    if (year == sys.year && month == sys.month && day < sys.day) return 0;
+int same_batch_key(BatchKey key1, BatchKey key2) {
+    return ((key1.head ^ key2.head) | (key1.tail ^ key2.tail)) == 0;
+}
 
-    return 1; // a data não é anterior
+/* Mixes both words of a key, so every digit reaches the low bits that pick a bucket */
+unsigned long hash_batch_key(BatchKey key) {
+    unsigned long long hash = (key.head ^ key.tail) * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 29;
+    hash = (hash ^ (unsigned long long)key.tail << 32) * 0xBF58476D1CE4E5B9ULL;
+    return hash ^ hash >> 32;
 }
 
-int is_already_vaccinated(VaccineSystem *system, const char *patient_name, const char *vaccine_name) {
-    Inoculation *current = system->inoculations;
+/*========================================= INTERN TABLES ==========================================*/
 
-    while (current != NULL) {
-        if (strcmp(current->user_name, patient_name) == 0 && 
-            strcmp(current->vaccine_name, vaccine_name) == 0 &&
-            current->application_date.year == system->current_date.year &&
-            current->application_date.month == system->current_date.month &&
-            current->application_date.day == system->current_date.day) {
-            return 1; // Patient already vaccinated on this day
-        }
-        current = current->next;
+/* FNV-1a hash of a string (patient and vaccine names) */
+unsigned long hash_string(const char *str) {
+    unsigned long hash = 2166136261UL;
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        hash = (hash ^ *c) * 16777619UL;
     }
+    return hash;
+}
 
-    return 0; // Patient hasnt been vaccinated today
+int init_intern_table(InternTable *table, size_t entry_size) {
+    table->capacity = INTERN_TABLE_INITIAL;
+    table->slots = calloc(table->capacity, sizeof(int));
+    table->names = NULL;
+    table->hashes = NULL;
+    table->entries = NULL;
+    table->entry_size = entry_size;
+    table->count = 0;
+    table->ids_capacity = 0;
+    table->lookups = 0;
+    table->probes = 0;
+    table->arena = (NameArena){NULL};
+    return table->slots != NULL;
 }
 
-int batch_exists(VaccineSystem *sys, char *batch) {
-    for (int i = 0; i < sys->batch_count; i++) {
-        if (strcmp(sys->batches[i].batch, batch) == 0) {
-            return 1;  // Batch exists
+/* Returns the slot holding the given name, or the empty slot where it belongs */
+unsigned long intern_slot(InternTable *table, const char *name, unsigned long hash) {
+    unsigned long mask = table->capacity - 1;
+    unsigned long i = hash & mask;
+
+    table->lookups++;
+    while (table->slots[i] != 0) {
+        int id = table->slots[i] - 1;
+        table->probes++;
+        if (table->hashes[id] == hash && strcmp(table->names[id], name) == 0) {
+            return i;
         }
+        i = (i + 1) & mask; // Linear probing
     }
-    return 0;  // Batch does not exist
+    return i;
 }
 
-/* Checks if the given inoculation matches the optional filters (date & batch) */
-int match_filters(Inoculation *inoculation, int args_parsed, int day, int month, int year, char *batch) {
-    if (args_parsed >= 3) {
-        if (inoculation->application_date.day != day ||
-            inoculation->application_date.month != month ||
-            inoculation->application_date.year != year) {
-            log_message("Skipping record: date does not match.");
-            return 0;  // Does not match
+/* Doubles the slots, rehashing every id into the new table */
+int grow_intern_slots(InternTable *table) {
+    int capacity = table->capacity * 2;
+    int *slots = calloc(capacity, sizeof(int));
+    if (!slots) return 0;
+
+    for (int id = 0; id < table->count; id++) {
+        unsigned long j = table->hashes[id] & (capacity - 1);
+        while (slots[j] != 0) {
+            j = (j + 1) & (capacity - 1);
         }
-        log_message("Date matches.");
+        slots[j] = id + 1;
     }
 
-    // if batch filter was provided (args_parsed == 5)
-    if (args_parsed == 4) {
-        if (strcmp(inoculation->batch, batch) != 0) {
-            log_message("Skipping record: batch does not match.");
-            return 0;  // Does not match
-        }
-        log_message("Batch matches.");
+    free(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+    return 1;
+}
+
+/* Doubles the per-id arrays (names, hashes and entries) */
+int grow_intern_ids(InternTable *table) {
+    int capacity = table->ids_capacity ? table->ids_capacity * 2 : INTERN_TABLE_INITIAL;
+
+    char **names = realloc(table->names, capacity * sizeof(char *));
+    if (!names) return 0;
+    table->names = names;
+
+    unsigned long *hashes = realloc(table->hashes, capacity * sizeof(unsigned long));
+    if (!hashes) return 0;
+    table->hashes = hashes;
+
+    char *entries = realloc(table->entries, capacity * table->entry_size);
+    if (!entries) return 0;
+    table->entries = entries;
+
+    table->ids_capacity = capacity;
+    return 1;
+}
+
+/* Returns the id of the given name, or -1 if it was never interned */
+int intern_lookup(InternTable *table, const char *name) {
+    return table->slots[intern_slot(table, name, hash_string(name))] - 1;
+}
+
+/* Returns the id of the given name, interning it with a zeroed entry if it is new */
+int intern_name(InternTable *table, const char *name) {
+    unsigned long hash = hash_string(name);
+    unsigned long slot = intern_slot(table, name, hash);
+    if (table->slots[slot] != 0) return table->slots[slot] - 1;
+
+    /* Keep the load factor under 3/4 */
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        if (!grow_intern_slots(table)) return -1;
+        slot = intern_slot(table, name, hash);
     }
+    if (table->count == table->ids_capacity && !grow_intern_ids(table)) return -1;
 
-    return 1;  // All filters match
+    int id = table->count;
+    table->names[id] = arena_strdup(&table->arena, name);
+    if (!table->names[id]) return -1;
+    table->hashes[id] = hash;
+    memset(intern_entry(table, id), 0, table->entry_size);
+
+    table->slots[slot] = id + 1;
+    table->count++;
+    return id;
+}
+
+/* Returns the entry attached to an id */
+void *intern_entry(InternTable *table, int id) {
+    return table->entries + (size_t)id * table->entry_size;
+}
+
+void free_intern_table(InternTable *table) {
+    free(table->slots);
+    free(table->names);
+    free(table->hashes);
+    free(table->entries);
+    free_name_arena(&table->arena);
+}
+
+Patient *get_patient(VaccineSystem *system, int id) {
+    return (Patient *)intern_entry(&system->patients, id);
+}
+
+/* Returns the patient with the given name, or NULL if it has no records */
+Patient *find_patient(VaccineSystem *system, const char *name) {
+    int id = intern_lookup(&system->patients, name);
+    if (id == -1) return NULL;
+
+    Patient *patient = get_patient(system, id);
+    return patient->count > 0 ? patient : NULL;
+}
+
+/*============================================ VACCINES ============================================*/
+
+/* Orders heap entries like the batch store: by expiration, then by batch */
+int compare_batch_refs(BatchRef *ref1, BatchRef *ref2) {
+    if (ref1->expiration != ref2->expiration) return ref1->expiration < ref2->expiration ? -1 : 1;
+    return compare_batch_keys(ref1->batch, ref2->batch);
 }
 
-/* Removes and frees a matched inoculation from the linked list */
-void remove_inoculation(VaccineSystem *sys, Inoculation **prev, Inoculation **curent) {
-    Inoculation *next_inoculation = (*curent)->next; // Save the next pointer before deleting
-    if (*prev) { (*prev)->next = next_inoculation; }
-    else { sys->inoculations = next_inoculation; }
-    free((*curent)->user_name);
-    free(*curent);
-    *curent = next_inoculation; // Move to the next inoculation 
+/* Makes room in the vaccine's heap for one more entry, so that the next push cannot fail */
+int reserve_vaccine_heap(Vaccine *vaccine) {
+    if (vaccine->heap_size < vaccine->heap_capacity) return 1;
+
+    int capacity = vaccine->heap_capacity ? vaccine->heap_capacity * 2 : VACCINE_HEAP_INITIAL;
+    BatchRef *heap = realloc(vaccine->heap, capacity * sizeof(BatchRef));
+    if (!heap) return 0;
+    vaccine->heap = heap;
+    vaccine->heap_capacity = capacity;
+    return 1;
+}
+
+/* Adds a new batch to the min-heap of its vaccine, already interned */
+int push_vaccine_batch(VaccineSystem *system, VaccineBatch *batch) {
+    Vaccine *vaccine = get_vaccine(system, batch->vaccine);
+    if (!reserve_vaccine_heap(vaccine)) return 0;
+
+    BatchRef ref;
+    ref.batch = batch->batch;
+    ref.expiration = batch->expiration;
+
+    /* Sift up */
+    int i = vaccine->heap_size++;
+    while (i > 0 && compare_batch_refs(&ref, &vaccine->heap[(i - 1) / 2]) < 0) {
+        vaccine->heap[i] = vaccine->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    vaccine->heap[i] = ref;
+    return 1;
+}
+
+/* Removes the top of the vaccine's heap */
+void pop_vaccine_batch(Vaccine *vaccine) {
+    BatchRef last = vaccine->heap[--vaccine->heap_size];
+    int i = 0, child;
+
+    /* Sift down */
+    while ((child = 2 * i + 1) < vaccine->heap_size) {
+        if (child + 1 < vaccine->heap_size &&
+            compare_batch_refs(&vaccine->heap[child + 1], &vaccine->heap[child]) < 0) {
+            child++;
+        }
+        if (compare_batch_refs(&vaccine->heap[child], &last) >= 0) break;
+        vaccine->heap[i] = vaccine->heap[child];
+        i = child;
+    }
+    vaccine->heap[i] = last;
 }
 
 /**
- * Função auxiliar para extrair apenas o nome do utente da linha de entrada.
+ * Returns the slot of the batch a heap entry refers to, or -1 if it can no
+ * longer be dispensed: removed (or replaced by another batch with the same
+ * identifier) or depleted. Neither can ever be undone, since doses are
+ * never added back. Expired entries never get here: t drops them.
  */
-int parse_patient_name(char *line, char **patient_name, char **remainder) {
-    *patient_name = NULL;
+int dispensable_batch(VaccineSystem *system, int vaccine_id, BatchRef *ref) {
+    int i = search_batch(system, ref->batch);
+    if (i == -1) return -1;
+
+    HotBatch *batch = &system->store.hot[i];
+    if (batch->vaccine != vaccine_id ||
+        batch->expiration != ref->expiration ||
+        batch->available_doses <= 0) {
+        return -1;
+    }
+    return i;
+}
+
+Vaccine *get_vaccine(VaccineSystem *system, int id) {
+    return (Vaccine *)intern_entry(&system->vaccines, id);
+}
+
+/* Returns the vaccine with the given name, or NULL if no batch ever had it */
+Vaccine *find_vaccine(VaccineSystem *system, const char *name) {
+    int id = intern_lookup(&system->vaccines, name);
+    return id != -1 ? intern_entry(&system->vaccines, id) : NULL;
+}
+
+/* Returns the position in the vaccine's list where the given batch is, or belongs (binary search) */
+int vaccine_position(VaccineSystem *system, Vaccine *vaccine, int slot) {
+    int low = 0, high = vaccine->batch_count;
 
-    // Jumps the command 
-    char *ptr = line + 1;
-    while (isspace(*ptr)) {
-        ptr++;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (compare_slots(&system->store, vaccine->batches[mid], slot) < 0) low = mid + 1;
+        else high = mid;
     }
+    return low;
+}
 
-    // if the name is between " "
-    if (*ptr == '"') {
-        ptr++;  
-        char *start = ptr;
-        while (*ptr != '"' && *ptr != '\0') {
-            ptr++;
-        }
-        if (*ptr != '"') {
-            puts("Error: Missing closing quote.");
-            return 0;
-        }
-        *patient_name = strndup(start, ptr - start);
-        if (!*patient_name) {
-            puts("Memory allocation error");
-            return 0;
-        }
-        ptr++; 
+/* Makes room in the vaccine's list for one more batch */
+int reserve_vaccine_batch(Vaccine *vaccine) {
+    if (vaccine->batch_count < vaccine->batch_capacity) return 1;
 
-    } else {
-        char *start = ptr;
-        while (!isspace(*ptr) && *ptr != '\0') {
-            ptr++;
-        }
-        *patient_name = strndup(start, ptr - start);
-        if (!*patient_name) {
-            puts("Memory allocation error");
-            return 0;
-        }
+    int capacity = vaccine->batch_capacity ? vaccine->batch_capacity * 2 : VACCINE_BATCHES_INITIAL;
+    int *batches = realloc(vaccine->batches, capacity * sizeof(int));
+    if (!batches) return 0;
+    vaccine->batches = batches;
+    vaccine->batch_capacity = capacity;
+    return 1;
+}
+
+/* Takes a stored batch out of its vaccine's list */
+void remove_vaccine_batch(VaccineSystem *system, int slot) {
+    Vaccine *vaccine = get_vaccine(system, system->store.hot[slot].vaccine);
+    int pos = vaccine_position(system, vaccine, slot);
+
+    memmove(&vaccine->batches[pos], &vaccine->batches[pos + 1], (vaccine->batch_count - pos - 1) * sizeof(int));
+    vaccine->batch_count--;
+}
+
+/* Drops the heap entries the system date left expired, all on top since the heap is by expiration */
+void drop_expired_refs(VaccineSystem *system, Vaccine *vaccine) {
+    while (vaccine->heap_size > 0 && is_before_system_date(system, vaccine->heap[0].expiration)) {
+        pop_vaccine_batch(vaccine);
+    }
+}
+
+void free_vaccines(InternTable *table) {
+    for (int id = 0; id < table->count; id++) {
+        Vaccine *vaccine = intern_entry(table, id);
+        free(vaccine->heap);
+        free(vaccine->batches);
     }
+}
 
-    while (isspace(*ptr)) {
-        ptr++;
+/*========================================== BATCH STORE ===========================================*/
+
+int init_batch_store(BatchStore *store, int limit) {
+    store->hot = NULL;
+    store->keys = NULL;
+    store->order = NULL;
+    store->free_slots = NULL;
+    store->count = 0;
+    store->free_count = 0;
+    store->slots_used = 0;
+    store->capacity = 0;
+    store->limit = limit;
+    store->expiry = NULL;
+    store->expiry_pos = NULL;
+    store->expiry_count = 0;
+
+    store->index.capacity = BATCH_INDEX_INITIAL;
+    store->index.count = 0;
+    store->index.buckets = malloc(BATCH_INDEX_INITIAL * sizeof(int));
+    if (!store->index.buckets) return 0;
+    for (int i = 0; i < BATCH_INDEX_INITIAL; i++) {
+        store->index.buckets[i] = -1;
     }
-    *remainder = ptr;
     return 1;
 }
+
+/* Checks whether the configured limit of live batches was reached */
+int batch_store_full(BatchStore *store) {
+    return store->limit > 0 && store->count >= store->limit;
+}
+
+/* Puts together the hot and cold parts of the batch in the given slot */
+VaccineBatch load_batch(BatchStore *store, int slot) {
+    HotBatch *hot = &store->hot[slot];
+    VaccineBatch batch;
+    batch.batch = store->keys[slot];
+    batch.vaccine = hot->vaccine;
+    batch.expiration = hot->expiration;
+    batch.available_doses = hot->available_doses;
+    batch.applied_doses = hot->applied_doses;
+    return batch;
+}
+
+void store_batch(BatchStore *store, int slot, VaccineBatch *batch) {
+    store->keys[slot] = batch->batch;
+    store->hot[slot] = (HotBatch){batch->expiration, batch->available_doses, batch->applied_doses, batch->vaccine};
+}
+
+/* Orders stored batches like compare_batches, reading the keys only on a tie */
+int compare_slots(BatchStore *store, int slot1, int slot2) {
+    Date expiration1 = store->hot[slot1].expiration, expiration2 = store->hot[slot2].expiration;
+    if (expiration1 != expiration2) return expiration1 < expiration2 ? -1 : 1;
+    return compare_batch_keys(store->keys[slot1], store->keys[slot2]);
+}
+
+/* Moves an array to a new one of the given size starting on a cache line, or returns NULL */
+void *grow_aligned(void *array, size_t used, size_t size) {
+    void *grown = aligned_alloc(CACHE_LINE_SIZE, (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+    if (!grown) return NULL;
+    if (used > 0) memcpy(grown, array, used);
+    free(array);
+    return grown;
+}
+
+/* Doubles the per-slot arrays */
+int grow_batch_store(BatchStore *store) {
+    int capacity = store->capacity ? store->capacity * 2 : BATCH_STORE_INITIAL;
+    int used = store->capacity;
+
+    HotBatch *hot = grow_aligned(store->hot, used * sizeof(HotBatch), capacity * sizeof(HotBatch));
+    if (!hot) return 0;
+    store->hot = hot;
+
+    BatchKey *keys = grow_aligned(store->keys, used * sizeof(BatchKey), capacity * sizeof(BatchKey));
+    if (!keys) return 0;
+    store->keys = keys;
+
+    int *order = realloc(store->order, capacity * sizeof(int));
+    if (!order) return 0;
+    store->order = order;
+
+    int *free_slots = realloc(store->free_slots, capacity * sizeof(int));
+    if (!free_slots) return 0;
+    store->free_slots = free_slots;
+
+    int *expiry = realloc(store->expiry, capacity * sizeof(int));
+    if (!expiry) return 0;
+    store->expiry = expiry;
+
+    int *expiry_pos = realloc(store->expiry_pos, capacity * sizeof(int));
+    if (!expiry_pos) return 0;
+    store->expiry_pos = expiry_pos;
+
+    store->capacity = capacity;
+    return 1;
+}
+
+/* Hands out a slot, reusing those released by r first */
+int alloc_batch_slot(BatchStore *store) {
+    if (store->free_count > 0) return store->free_slots[--store->free_count];
+    if (store->slots_used == store->capacity && !grow_batch_store(store)) return -1;
+    return store->slots_used++;
+}
+
+/* Returns the position in order where the batch in the given slot is, or belongs (binary search) */
+int order_position(VaccineSystem *system, int slot) {
+    int low = 0, high = system->store.count;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (compare_slots(&system->store, system->store.order[mid], slot) < 0) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/* Takes a batch out of the store, shifting only the slot numbers that follow it */
+void remove_batch(VaccineSystem *system, int slot) {
+    BatchStore *store = &system->store;
+    int pos = order_position(system, slot);
+
+    memmove(&store->order[pos], &store->order[pos + 1], (store->count - pos - 1) * sizeof(int));
+    store->count--;
+    remove_vaccine_batch(system, slot);
+    if (store->expiry_pos[slot] != -1) remove_expiry(system, slot);
+    unindex_batch(system, slot);
+    store->free_slots[store->free_count++] = slot;
+}
+
+void free_batch_store(BatchStore *store) {
+    free(store->hot);
+    free(store->keys);
+    free(store->order);
+    free(store->free_slots);
+    free(store->expiry);
+    free(store->expiry_pos);
+    free(store->index.buckets);
+}
+
+/* Returns the bucket holding the given batch, or the empty bucket where it belongs */
+unsigned long batch_bucket(VaccineSystem *system, BatchKey batch) {
+    BatchIndex *index = &system->store.index;
+    unsigned long mask = index->capacity - 1;
+    unsigned long i = hash_batch_key(batch) & mask;
+    int slot;
+
+    system->stats.index_lookups++;
+    while ((slot = index->buckets[i]) != -1) {
+        system->stats.index_probes++;
+        if (same_batch_key(system->store.keys[slot], batch)) return i;
+        i = (i + 1) & mask; // Linear probing
+    }
+    return i;
+}
+
+/* Doubles the index, rehashing every live batch */
+int grow_batch_index(VaccineSystem *system) {
+    BatchIndex *index = &system->store.index;
+    int capacity = index->capacity * 2;
+    int *buckets = malloc(capacity * sizeof(int));
+    if (!buckets) return 0;
+
+    for (int i = 0; i < capacity; i++) {
+        buckets[i] = -1;
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->capacity = capacity;
+
+    for (int i = 0; i < system->store.count; i++) {
+        int slot = system->store.order[i];
+        index->buckets[batch_bucket(system, system->store.keys[slot])] = slot;
+    }
+    return 1;
+}
+
+/* Adds the batch stored at the given slot to the index */
+int index_batch(VaccineSystem *system, int slot) {
+    BatchIndex *index = &system->store.index;
+
+    /* Keep the load factor under 1/2 */
+    if ((index->count + 1) * 2 > index->capacity && !grow_batch_index(system)) return 0;
+
+    index->buckets[batch_bucket(system, system->store.keys[slot])] = slot;
+    index->count++;
+    return 1;
+}
+
+/* Removes the batch stored at the given slot from the index (backward-shift deletion) */
+void unindex_batch(VaccineSystem *system, int slot) {
+    BatchIndex *index = &system->store.index;
+    int *buckets = index->buckets;
+    unsigned long mask = index->capacity - 1;
+    unsigned long hole = batch_bucket(system, system->store.keys[slot]);
+
+    buckets[hole] = -1;
+    index->count--;
+    for (unsigned long i = (hole + 1) & mask; buckets[i] != -1; i = (i + 1) & mask) {
+        unsigned long home = hash_batch_key(system->store.keys[buckets[i]]) & mask;
+
+        /* Move the entry back if the hole lies between its home bucket and it */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            buckets[hole] = buckets[i];
+            buckets[i] = -1;
+            hole = i;
+        }
+    }
+}
+
+/*============================================= EXPIRY =============================================*/
+
+void place_expiry(BatchStore *store, int pos, int slot) {
+    store->expiry[pos] = slot;
+    store->expiry_pos[slot] = pos;
+}
+
+/* Moves the slot at the given position up, or else down, to where it belongs in the heap */
+void sift_expiry(VaccineSystem *system, int pos) {
+    BatchStore *store = &system->store;
+    int slot = store->expiry[pos], child;
+
+    while (pos > 0 && compare_slots(store, slot, store->expiry[(pos - 1) / 2]) < 0) {
+        place_expiry(store, pos, store->expiry[(pos - 1) / 2]);
+        pos = (pos - 1) / 2;
+    }
+    while ((child = 2 * pos + 1) < store->expiry_count) {
+        if (child + 1 < store->expiry_count &&
+            compare_slots(store, store->expiry[child + 1], store->expiry[child]) < 0) {
+            child++;
+        }
+        if (compare_slots(store, store->expiry[child], slot) >= 0) break;
+        place_expiry(store, pos, store->expiry[child]);
+        pos = child;
+    }
+    place_expiry(store, pos, slot);
+}
+
+/* The heap has room for every slot, so pushing cannot fail */
+void push_expiry(VaccineSystem *system, int slot) {
+    BatchStore *store = &system->store;
+    place_expiry(store, store->expiry_count++, slot);
+    sift_expiry(system, store->expiry_count - 1);
+}
+
+void remove_expiry(VaccineSystem *system, int slot) {
+    BatchStore *store = &system->store;
+    int pos = store->expiry_pos[slot];
+    int last = store->expiry[--store->expiry_count];
+
+    store->expiry_pos[slot] = -1;
+    if (pos < store->expiry_count) {
+        place_expiry(store, pos, last);
+        sift_expiry(system, pos);
+    }
+}
+
+/**
+ * Retires the batches the new system date left expired, earliest first:
+ * each leaves the heap, its vaccine stops dispensing it and it is kept for
+ * e, with the doses it still had. Each batch expires once, so over time
+ * this costs one heap removal per batch.
+ */
+void expire_batches(VaccineSystem *system) {
+    BatchStore *store = &system->store;
+    system->expired.count = 0;
+
+    while (store->expiry_count > 0) {
+        int slot = store->expiry[0];
+        if (!is_before_system_date(system, store->hot[slot].expiration)) break;
+
+        remove_expiry(system, slot);
+        drop_expired_refs(system, get_vaccine(system, store->hot[slot].vaccine));
+        VaccineBatch batch = load_batch(store, slot);
+        if (!keep_expired(&system->expired, &batch)) TRACE("Error: Expired batch not kept for the report.");
+    }
+}
+
+/* Adds a batch to the expiry report, returning 0 if out of memory */
+int keep_expired(ExpiredBatches *expired, VaccineBatch *batch) {
+    if (expired->count == expired->capacity) {
+        int capacity = expired->capacity ? expired->capacity * 2 : VACCINE_BATCHES_INITIAL;
+        VaccineBatch *batches = realloc(expired->batches, capacity * sizeof(VaccineBatch));
+        if (!batches) return 0;
+        expired->batches = batches;
+        expired->capacity = capacity;
+    }
+    expired->batches[expired->count++] = *batch;
+    return 1;
+}
+
+/*====================================== INOCULATION STORAGE =======================================*/
+
+/* Returns the record at a given position of the log */
+Inoculation *log_record(InoculationLog *log, int pos) {
+    return &log->chunks[pos / INOCULATION_CHUNK_SIZE][pos % INOCULATION_CHUNK_SIZE];
+}
+
+/**
+ * Appends a record to the log and to its patient's records. Since the system
+ * date never goes back, appending keeps both in chronological order.
+ */
+int append_inoculation(VaccineSystem *system, Inoculation *inoculation) {
+    InoculationLog *log = &system->log;
+    Patient *patient = get_patient(system, inoculation->patient);
+
+    if (patient->count == patient->capacity) {
+        int capacity = patient->capacity ? patient->capacity * 2 : PATIENT_RECORDS_INITIAL;
+        int *records = realloc(patient->records, capacity * sizeof(int));
+        if (!records) return 0;
+        patient->records = records;
+        patient->capacity = capacity;
+    }
+
+    if (log->size == log->chunk_count * INOCULATION_CHUNK_SIZE) {
+        if (log->chunk_count == log->chunks_capacity) {
+            int capacity = log->chunks_capacity ? log->chunks_capacity * 2 : LOG_CHUNKS_INITIAL;
+            Inoculation **chunks = realloc(log->chunks, capacity * sizeof(Inoculation *));
+            if (!chunks) return 0;
+            log->chunks = chunks;
+            log->chunks_capacity = capacity;
+        }
+        log->chunks[log->chunk_count] = malloc(INOCULATION_CHUNK_SIZE * sizeof(Inoculation));
+        if (!log->chunks[log->chunk_count]) return 0;
+        log->chunk_count++;
+    }
+
+    *log_record(log, log->size) = *inoculation;
+    patient->records[patient->count++] = log->size;
+    log->size++;
+    log->live++;
+    return 1;
+}
+
+/**
+ * Finds the run of a patient's records applied on the given date, as
+ * [first, end) in its record list. The list is in log order, and so by
+ * date, since the system date never goes back.
+ */
+void find_date_records(VaccineSystem *system, Patient *patient, Date date, int *first, int *end) {
+    int low = 0, high = patient->count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (log_record(&system->log, patient->records[mid])->application_date < date) low = mid + 1;
+        else high = mid;
+    }
+    *first = low;
+
+    high = patient->count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (log_record(&system->log, patient->records[mid])->application_date <= date) low = mid + 1;
+        else high = mid;
+    }
+    *end = low;
+}
+
+/**
+ * Reclaims deleted records once they outnumber the live ones: live records
+ * are slid down in order, every patient's positions are rebuilt and the
+ * chunks left empty are freed.
+ */
+void compact_inoculation_log(VaccineSystem *system) {
+    InoculationLog *log = &system->log;
+    int deleted = log->size - log->live;
+    if (deleted < INOCULATION_CHUNK_SIZE || deleted <= log->live) return;
+    if (system->readers != NULL && readers_out(system->readers)) return; // Records are being read in place
+
+    TRACE("Compacting inoculation log.");
+    for (int id = 0; id < system->patients.count; id++) {
+        get_patient(system, id)->count = 0;
+    }
+
+    int kept = 0;
+    for (int pos = 0; pos < log->size; pos++) {
+        Inoculation *inoculation = log_record(log, pos);
+        if (inoculation->deleted) continue;
+
+        /* Capacities suffice: each patient gets back exactly its live records */
+        Patient *patient = get_patient(system, inoculation->patient);
+        patient->records[patient->count++] = kept;
+        *log_record(log, kept++) = *inoculation;
+    }
+    log->size = kept;
+
+    int needed = (kept + INOCULATION_CHUNK_SIZE - 1) / INOCULATION_CHUNK_SIZE;
+    while (log->chunk_count > needed) {
+        free(log->chunks[--log->chunk_count]);
+    }
+}
+
+void free_inoculation_log(InoculationLog *log) {
+    for (int i = 0; i < log->chunk_count; i++) {
+        free(log->chunks[i]);
+    }
+    free(log->chunks);
+}
+
+void free_patient_records(VaccineSystem *system) {
+    for (int id = 0; id < system->patients.count; id++) {
+        free(get_patient(system, id)->records);
+    }
+}
+
+/* Copies a string into the arena, opening a new chunk when the current one is full */
+char *arena_strdup(NameArena *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    ArenaChunk *chunk = arena->chunks;
+
+    if (chunk == NULL || chunk->size - chunk->used < len) {
+        size_t size = len > NAME_ARENA_CHUNK ? len : NAME_ARENA_CHUNK;
+        chunk = malloc(sizeof(ArenaChunk) + size);
+        if (!chunk) return NULL;
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    char *copy = chunk->bytes + chunk->used;
+    memcpy(copy, str, len);
+    chunk->used += len;
+    return copy;
+}
+
+void free_name_arena(NameArena *arena) {
+    while (arena->chunks != NULL) {
+        ArenaChunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+}
+
+/*============================================= INPUT ==============================================*/
+
+int init_input_reader(InputReader *reader, FILE *stream, OutputBuffer *output) {
+    reader->stream = stream;
+    reader->output = output;
+    reader->journal = NULL;
+    reader->buffer = malloc(INPUT_BLOCK_SIZE + 1); // Room to terminate a last line without newline
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = 0;
+    reader->pause_before_read = 0;
+    reader->paused = 0;
+    reader->args_capacity = COMMAND_ARGS_INITIAL;
+    reader->args = malloc(reader->args_capacity * sizeof(Token));
+    return reader->buffer != NULL && reader->args != NULL;
+}
+
+/**
+ * Returns the next line with its newline replaced by '\0', or NULL at the end
+ * of the input, and its length without the newline. The line stays in the
+ * buffer until the next call; only a partial line is ever moved, when the
+ * next block is read after it.
+ */
+char *next_line(InputReader *reader, size_t *length, int *has_newline) {
+    while (1) {
+        char *begin = reader->buffer + reader->start;
+        size_t pending = reader->end - reader->start;
+
+        char *newline = memchr(begin, '\n', pending);
+        if (newline != NULL) {
+            *newline = '\0';
+            *length = newline - begin;
+            reader->start += *length + 1;
+            *has_newline = 1;
+            return begin;
+        }
+
+        /* Last line without newline, or a line longer than a whole block */
+        if (reader->eof || pending == INPUT_BLOCK_SIZE) {
+            if (pending == 0) return NULL;
+            begin[pending] = '\0';
+            reader->start = reader->end;
+            *length = pending;
+            *has_newline = 0;
+            return begin;
+        }
+
+        /* Whatever answers the lines so far must be out before blocking on a read */
+        if (reader->pause_before_read && !reader->paused) {
+            reader->paused = 1; // The caller hands them over itself, then calls again
+            return NULL;
+        }
+        reader->paused = 0;
+        if (reader->output != NULL) flush_output(reader->output);
+
+        memmove(reader->buffer, begin, pending);
+        reader->start = 0;
+        reader->end = pending;
+        /* read returns what is available, so lines typed one at a time are answered */
+        ssize_t bytes;
+        do {
+            bytes = read(fileno(reader->stream), reader->buffer + pending, INPUT_BLOCK_SIZE - pending);
+        } while (bytes < 0 && errno == EINTR);
+        if (bytes <= 0) reader->eof = 1;
+        else reader->end += bytes;
+    }
+}
+
+/**
+ * Reads and tokenizes the next command, returning 0 at the end of the input.
+ * A line that could not be stored comes back as a command with no name.
+ */
+int read_command(InputReader *reader, Command *command) {
+    int has_newline;
+    size_t length;
+    char *line = next_line(reader, &length, &has_newline);
+    if (line == NULL) return 0;
+
+    parse_command(reader, line, length, has_newline, command);
+    return 1;
+}
+
+/* Journals a line that changes the system, then tokenizes it */
+void parse_command(InputReader *reader, char *line, size_t length, int has_newline, Command *command) {
+    command->journal_offset = 0;
+    if (reader->journal != NULL) {
+        /* Commands that change the system are journaled before they run */
+        if (is_journaled(line)) journal_command(reader->journal, line, length);
+        /* and a snapshot never covers commands that could still be lost */
+        else if (line[0] == 'w') commit_journal(reader->journal);
+        command->journal_offset = reader->journal->offset + reader->journal->used;
+    }
+
+    if (!tokenize_command(reader, line, has_newline, command)) {
+        command->name = '\0';
+        command->error = "Memory allocation error";
+    }
+}
+
+/**
+ * Splits a line into the arguments of its command, in a single pass.
+ * Arguments point into the line itself, which is terminated in place.
+ */
+int tokenize_command(InputReader *reader, char *line, int has_newline, Command *command) {
+    char *cursor = line + 1; // Jumps the command
+    Token *args = reader->args;
+
+    command->name = line[0];
+    command->error = NULL;
+    command->argc = 0;
+    command->date_fields = 0;
+    command->day = command->month = command->year = 0;
+    command->quantity = 0;
+
+    switch (line[0]) {
+        case 'c':
+            args[0] = next_word(&cursor); // Batch
+            command->date_fields = parse_date(next_word(&cursor).text, command);
+            if (parse_number(next_word(&cursor).text, &command->quantity) == NULL) {
+                command->quantity = 0;
+            }
+            args[1] = next_word(&cursor); // Vaccine name
+            command->argc = 2;
+            break;
+        case 'l':
+            /* Vaccine names are separated by spaces only */
+            while (isspace((unsigned char)*cursor)) cursor++;
+            while (*cursor != '\0') {
+                if (*cursor == ' ') {
+                    cursor++;
+                    continue;
+                }
+                if (command->argc == reader->args_capacity && !grow_command_args(reader)) return 0;
+                Token *name = &reader->args[command->argc++];
+                name->text = cursor;
+                while (*cursor != '\0' && *cursor != ' ') cursor++;
+                name->length = cursor - name->text;
+                if (*cursor != '\0') *cursor++ = '\0';
+            }
+            break;
+        case 'a':
+            if (parse_patient_name(&cursor, &args[0], command)) {
+                args[1] = next_word(&cursor); // Vaccine name
+                command->argc = args[1].length > 0 ? 2 : 1;
+            }
+            break;
+        case 'r':
+            args[0] = next_word(&cursor);
+            truncate_token(&args[0], MAX_BATCH_LENGTH);
+            command->argc = args[0].length > 0;
+            break;
+        case 'd':
+            if (parse_patient_name(&cursor, &args[0], command)) {
+                command->argc = 1;
+                command->date_fields = parse_date(next_word(&cursor).text, command);
+                if (command->date_fields == 3) {
+                    args[1] = next_word(&cursor); // Batch
+                    truncate_token(&args[1], MAX_BATCH_LENGTH);
+                    if (args[1].length > 0) command->argc = 2;
+                }
+            }
+            break;
+        case 'u':
+            /* Only look for a name if there is more than "u\n" */
+            if (strlen(line) + has_newline > 2 && parse_patient_name(&cursor, &args[0], command)) {
+                command->argc = 1;
+            }
+            break;
+        case 't':
+            command->date_fields = parse_date(next_word(&cursor).text, command);
+            break;
+        case 'w':
+            args[0] = next_word(&cursor); // File
+            command->argc = args[0].length > 0;
+            break;
+        default:
+            break;
+    }
+
+    command->args = reader->args;
+    return 1;
+}
+
+/* Doubles the argument storage shared by every command */
+int grow_command_args(InputReader *reader) {
+    int capacity = reader->args_capacity * 2;
+    Token *args = realloc(reader->args, capacity * sizeof(Token));
+    if (!args) return 0;
+
+    reader->args = args;
+    reader->args_capacity = capacity;
+    return 1;
+}
+
+/* Returns the next whitespace-separated word, terminated in place (empty at the end of the line) */
+Token next_word(char **cursor) {
+    char *ptr = *cursor;
+    while (isspace((unsigned char)*ptr)) ptr++;
+
+    Token word = {ptr, 0};
+    while (*ptr != '\0' && !isspace((unsigned char)*ptr)) ptr++;
+    word.length = ptr - word.text;
+
+    if (*ptr != '\0') *ptr++ = '\0';
+    *cursor = ptr;
+    return word;
+}
+
+/**
+ * Reads the patient name, either a word or a text between quotes, without
+ * copying it. Returns 0, setting the command's error, if the closing quote is missing.
+ */
+int parse_patient_name(char **cursor, Token *patient_name, Command *command) {
+    char *ptr = *cursor;
+    while (isspace((unsigned char)*ptr)) ptr++;
+
+    // if the name is not between " " it is a single word
+    if (*ptr != '"') {
+        *patient_name = next_word(&ptr);
+        *cursor = ptr;
+        return 1;
+    }
+
+    char *start = ptr + 1;
+    char *end = strchr(start, '"');
+    if (end == NULL) {
+        command->error = "Error: Missing closing quote.";
+        return 0;
+    }
+
+    *end = '\0';
+    patient_name->text = start;
+    patient_name->length = end - start;
+    *cursor = end + 1;
+    return 1;
+}
+
+/* Keeps at most max_length bytes of a token, as a "%20s" conversion would */
+void truncate_token(Token *token, int max_length) {
+    if (token->length > max_length) {
+        token->text[max_length] = '\0';
+        token->length = max_length;
+    }
+}
+
+/**
+ * Reads an optionally signed decimal integer, saturating on overflow.
+ * Returns a pointer past its last digit, or NULL if there are no digits.
+ */
+char *parse_number(char *text, int *value) {
+    int negative = *text == '-';
+    if (*text == '-' || *text == '+') text++;
+    if (!isdigit((unsigned char)*text)) return NULL;
+
+    long long number = 0;
+    for (; isdigit((unsigned char)*text); text++) {
+        if (number <= INT_MAX) number = number * 10 + (*text - '0');
+    }
+    if (number > INT_MAX) number = INT_MAX;
+
+    *value = negative ? -number : number;
+    return text;
+}
+
+/* Reads <day>-<month>-<year> into the command, returning how many fields were read */
+int parse_date(char *text, Command *command) {
+    int *fields[3] = {&command->day, &command->month, &command->year};
+
+    for (int i = 0; i < 3; i++) {
+        if (i > 0 && *text++ != '-') return i;
+        text = parse_number(text, fields[i]);
+        if (text == NULL) return i;
+    }
+    return 3;
+}
+
+void free_input_reader(InputReader *reader) {
+    free(reader->buffer);
+    free(reader->args);
+}
+
+/* Copies a command and its arguments, which otherwise live in the line it was read from */
+int copy_command(CommandCopy *copy, Command *command) {
+    size_t size = 0;
+    for (int k = 0; k < command->argc; k++) {
+        size += command->args[k].length + 1;
+    }
+    if (size > copy->text_capacity) {
+        char *text = realloc(copy->text, size);
+        if (!text) return 0;
+        copy->text = text;
+        copy->text_capacity = size;
+    }
+    if (command->argc > copy->args_capacity) {
+        Token *args = realloc(copy->args, command->argc * sizeof(Token));
+        if (!args) return 0;
+        copy->args = args;
+        copy->args_capacity = command->argc;
+    }
+
+    copy->command = *command;
+    copy->command.args = copy->args;
+    char *text = copy->text;
+    for (int k = 0; k < command->argc; k++) {
+        memcpy(text, command->args[k].text, command->args[k].length);
+        text[command->args[k].length] = '\0';
+        copy->args[k].text = text;
+        copy->args[k].length = command->args[k].length;
+        text += command->args[k].length + 1;
+    }
+    return 1;
+}
+
+void free_command_copy(CommandCopy *copy) {
+    free(copy->text);
+    free(copy->args);
+}
+
+/*============================================= OUTPUT =============================================*/
+
+int init_output_buffer(OutputBuffer *out, FILE *stream) {
+    out->stream = stream;
+    out->journal = NULL;
+    out->chunk = NULL;
+    out->chunks = NULL;
+    out->free_chunks = NULL;
+    out->pending = NULL;
+    out->buffer = malloc(OUTPUT_BUFFER_SIZE);
+    out->used = 0;
+    return out->buffer != NULL;
+}
+
+/* Writes out the buffer, once the commands it answers are safely journaled */
+void flush_output(OutputBuffer *out) {
+    if (out->journal != NULL) commit_journal(out->journal);
+    if (out->chunks != NULL) {
+        hand_output(out);
+        return;
+    }
+    if (out->pending != NULL) {
+        queue_output(out->pending, out->buffer, out->used);
+        out->used = 0;
+        return;
+    }
+    if (out->stream == NULL) {
+        out->used = 0; // Output is being discarded
+        return;
+    }
+    if (out->used > 0) {
+        fwrite(out->buffer, 1, out->used, out->stream);
+        out->used = 0;
+    }
+    fflush(out->stream);
+}
+
+/* Passes the buffer to the writer thread, carrying on in a chunk it is done with */
+void hand_output(OutputBuffer *out) {
+    if (out->used == 0 && out->chunk->job == NULL) return;
+    out->chunk->used = out->used;
+    ring_push(out->chunks, out->chunk);
+    out->chunk = ring_pop(out->free_chunks);
+    out->buffer = out->chunk->bytes;
+    out->used = 0;
+}
+
+/* Makes room for the given number of bytes, flushing the buffer if needed */
+void reserve_output(OutputBuffer *out, size_t size) {
+    if (out->used + size > OUTPUT_BUFFER_SIZE) flush_output(out);
+}
+
+void write_bytes(OutputBuffer *out, const char *bytes, size_t size) {
+    reserve_output(out, size);
+    while (size > 0) {
+        if (out->used == OUTPUT_BUFFER_SIZE) flush_output(out); // Too big to be buffered at once
+        size_t part = size < OUTPUT_BUFFER_SIZE - out->used ? size : OUTPUT_BUFFER_SIZE - out->used;
+        memcpy(out->buffer + out->used, bytes, part);
+        out->used += part;
+        bytes += part;
+        size -= part;
+    }
+}
+
+void write_string(OutputBuffer *out, const char *str) {
+    write_bytes(out, str, strlen(str));
+}
+
+void write_char(OutputBuffer *out, char c) {
+    reserve_output(out, 1);
+    out->buffer[out->used++] = c;
+}
+
+/* Writes a string and a newline, like puts */
+void write_line(OutputBuffer *out, const char *str) {
+    write_string(out, str);
+    write_char(out, '\n');
+}
+
+/* Writes "<name>: <message>\n" */
+void write_error(OutputBuffer *out, const char *name, const char *message) {
+    write_string(out, name);
+    write_bytes(out, ": ", 2);
+    write_line(out, message);
+}
+
+/* Writes a decimal integer padded with zeros to at least width characters, like "%0*d" */
+void write_padded_int(OutputBuffer *out, int value, int width) {
+    char digits[16];
+    int count = 0;
+    unsigned int magnitude = value < 0 ? -(unsigned int)value : (unsigned int)value;
+
+    do {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    reserve_output(out, count + width + 1);
+    if (value < 0) {
+        out->buffer[out->used++] = '-';
+        width--;
+    }
+    for (int i = count; i < width; i++) {
+        out->buffer[out->used++] = '0';
+    }
+    while (count > 0) {
+        out->buffer[out->used++] = digits[--count];
+    }
+}
+
+void write_int(OutputBuffer *out, int value) {
+    write_padded_int(out, value, 0);
+}
+
+/* Writes a date as dd-mm-yyyy */
+void write_date(OutputBuffer *out, Date date) {
+    int day, month, year;
+    split_date(date, &day, &month, &year);
+    write_padded_int(out, day, 2);
+    write_char(out, '-');
+    write_padded_int(out, month, 2);
+    write_char(out, '-');
+    write_padded_int(out, year, 4);
+}
+
+/* Writes a batch identifier back from its key */
+void write_batch_key(OutputBuffer *out, BatchKey key) {
+    int length = key.tail & 0xFF;
+    reserve_output(out, length);
+    for (int i = 0; i < length; i++) {
+        unsigned int digit = i < BATCH_KEY_HEAD_DIGITS ? key.head >> (60 - 4 * i) & 0xF
+                                                       : key.tail >> (20 - 4 * (i - BATCH_KEY_HEAD_DIGITS)) & 0xF;
+        out->buffer[out->used++] = "0123456789ABCDEF"[digit];
+    }
+}
+
+void free_output_buffer(OutputBuffer *out) {
+    free(out->buffer);
+}
+
+/*============================================= STATS ==============================================*/
+
+/* Monotonic time in nanoseconds */
+long stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+CommandStats *find_command_stats(Stats *stats, char name) {
+    return name >= 'a' && name <= 'z' ? &stats->commands[name - 'a'] : NULL;
+}
+
+/* Returns the start time if this run of the command is to be timed, or -1 */
+long start_timing(CommandStats *command) {
+    if (command == NULL || command->count % LATENCY_SAMPLE_EVERY != 0) return -1;
+    return stats_clock();
+}
+
+/* Counts a command and, if it was timed, adds its latency to a power-of-two histogram */
+void record_command(CommandStats *command, long start) {
+    if (command == NULL) return;
+    command->count++;
+    if (start == -1) return;
+
+    long nanoseconds = stats_clock() - start;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && nanoseconds >= 1L << bucket) bucket++;
+
+    command->timed++;
+    command->total_ns += nanoseconds;
+    if (nanoseconds > command->max_ns) command->max_ns = nanoseconds;
+    command->buckets[bucket]++;
+}
+
+/* Counts a scan over a list and how many elements it visited */
+void record_scan(ScanStats *scan, int length) {
+    scan->scans++;
+    scan->visited += length;
+    if (length > scan->longest) scan->longest = length;
+}
+
+/* Upper bound, in nanoseconds, of the histogram bucket holding the given percentile */
+long latency_percentile(CommandStats *command, int percent) {
+    long rank = (command->timed * percent + 99) / 100, seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += command->buckets[bucket];
+        if (seen >= rank) {
+            long bound = 1L << bucket;
+            return bucket < LATENCY_BUCKETS - 1 && bound < command->max_ns ? bound : command->max_ns;
+        }
+    }
+    return command->max_ns;
+}
+
+void print_probes(OutputBuffer *out, const char *name, long lookups, long probes) {
+    char line[STATS_LINE_LENGTH];
+    snprintf(line, sizeof(line), "%s: %ld lookups, %ld probes (%.2f per lookup)",
+             name, lookups, probes, lookups ? (double)probes / lookups : 0.0);
+    write_line(out, line);
+}
+
+void print_scans(OutputBuffer *out, const char *name, ScanStats *scan) {
+    char line[STATS_LINE_LENGTH];
+    snprintf(line, sizeof(line), "%s: %ld scans, %ld visited (%.2f per scan), longest %ld",
+             name, scan->scans, scan->visited,
+             scan->scans ? (double)scan->visited / scan->scans : 0.0, scan->longest);
+    write_line(out, line);
+}
+
+/**
+ * Prints the count and latency distribution of every command run so far,
+ * then the probe lengths of the hash tables and the scan lengths of lists.
+ * Latencies come from the timed runs only; percentiles are the upper
+ * bounds of their histogram buckets.
+ */
+void print_stats(Stats *stats, VaccineSystem *system, OutputBuffer *out) {
+    char line[STATS_LINE_LENGTH];
+    write_line(out, "command count timed mean_us p50_us p90_us p99_us max_us");
+
+    for (int i = 0; i < COMMAND_LETTERS; i++) {
+        CommandStats *command = &stats->commands[i];
+        if (command->count == 0) continue;
+        snprintf(line, sizeof(line), "%c %ld %ld %.2f %.2f %.2f %.2f %.2f", 'a' + i,
+                 command->count, command->timed,
+                 command->total_ns / 1000.0 / command->timed,
+                 latency_percentile(command, 50) / 1000.0,
+                 latency_percentile(command, 90) / 1000.0,
+                 latency_percentile(command, 99) / 1000.0,
+                 command->max_ns / 1000.0);
+        write_line(out, line);
+    }
+
+    print_probes(out, "batch index", stats->index_lookups, stats->index_probes);
+    print_probes(out, "patient names", system->patients.lookups, system->patients.probes);
+    print_probes(out, "vaccine names", system->vaccines.lookups, system->vaccines.probes);
+    print_scans(out, "batch scans (l)", &stats->batch_scans);
+    print_scans(out, "record scans (u, d)", &stats->record_scans);
+
+    if (system->journal.fd != -1) {
+        snprintf(line, sizeof(line), "journal: %ld commands, %ld commits (%.2f per commit)",
+                 system->journal.entries, system->journal.commits,
+                 system->journal.commits ? (double)system->journal.entries / system->journal.commits : 0.0);
+        write_line(out, line);
+    }
+}
+
+/* Prints the stats on stderr, so they stay out of the commands' output */
+void report_stats_on_exit(VaccineSystem *system) {
+    OutputBuffer err;
+    if (!init_output_buffer(&err, stderr)) return;
+    print_stats(&system->stats, system, &err);
+    flush_output(&err);
+    free_output_buffer(&err);
+}
+
+/*============================================ SNAPSHOT ============================================*/
+
+/**
+ * Writes the vaccine names by id, the batches in list order, the system
+ * date, the names of the patients with records and the live inoculations
+ * in log order. The file
+ * is written next to its destination and renamed over it once complete,
+ * along with the journal offset up to which its commands are included.
+ */
+int save_snapshot(VaccineSystem *system, const char *path, long long journal_offset) {
+    char temp_path[SNAPSHOT_PATH_LENGTH];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) return 0;
+
+    /* Patients are renumbered densely, keeping only those with records */
+    int *numbers = malloc((system->patients.count + 1) * sizeof(int));
+    if (!numbers) return 0;
+
+    SnapshotHeader header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, sizeof(VaccineBatch), sizeof(Inoculation),
+                             system->current_date, system->vaccines.count, 0, system->store.count, 0,
+                             system->log.live, 0, system->expired.count, journal_offset};
+    for (int id = 0; id < system->vaccines.count; id++) {
+        header.vaccine_name_bytes += strlen(system->vaccines.names[id]) + 1;
+    }
+    for (int id = 0; id < system->patients.count; id++) {
+        numbers[id] = -1;
+        if (get_patient(system, id)->count > 0) {
+            numbers[id] = header.patient_count++;
+            header.name_bytes += strlen(system->patients.names[id]) + 1;
+        }
+    }
+
+    FILE *file = fopen(temp_path, "wb");
+    int ok = file != NULL && fwrite(&header, sizeof(header), 1, file) == 1;
+
+    /* Every vaccine ever interned, so that batches and records keep their ids */
+    for (int id = 0; ok && id < system->vaccines.count; id++) {
+        const char *name = system->vaccines.names[id];
+        ok = fwrite(name, strlen(name) + 1, 1, file) == 1;
+    }
+    for (int i = 0; ok && i < system->store.count; i++) {
+        VaccineBatch batch = load_batch(&system->store, system->store.order[i]);
+        ok = fwrite(&batch, sizeof(VaccineBatch), 1, file) == 1;
+    }
+    for (int id = 0; ok && id < system->patients.count; id++) {
+        if (numbers[id] == -1) continue;
+        const char *name = system->patients.names[id];
+        ok = fwrite(name, strlen(name) + 1, 1, file) == 1;
+    }
+    for (int pos = 0; ok && pos < system->log.size; pos++) {
+        Inoculation inoculation = *log_record(&system->log, pos);
+        if (inoculation.deleted) continue;
+        inoculation.patient = numbers[inoculation.patient];
+        ok = fwrite(&inoculation, sizeof(Inoculation), 1, file) == 1;
+    }
+    if (ok && system->expired.count > 0) {
+        ok = fwrite(system->expired.batches, sizeof(VaccineBatch), system->expired.count, file) ==
+             (size_t)system->expired.count;
+    }
+
+    free(numbers);
+    if (file != NULL) {
+        ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+        ok = fclose(file) == 0 && ok;
+    }
+    if (ok) ok = rename(temp_path, path) == 0;
+    if (!ok) remove(temp_path);
+    return ok;
+}
+
+/* Whether a batch read back from a snapshot could have been added by c */
+int is_valid_snapshot_batch(VaccineBatch *batch, unsigned vaccine_count) {
+    return batch->vaccine >= 0 && (unsigned)batch->vaccine < vaccine_count &&
+           is_valid_batch_key(batch->batch) && is_valid_day_number(batch->expiration) &&
+           batch->available_doses >= 0 && batch->applied_doses >= 0;
+}
+
+/**
+ * Rebuilds the system from a snapshot, read in place through mmap. The
+ * batch store, vaccine heaps, patients and log are filled as if the
+ * surviving batches and inoculations had just been added in order.
+ * Also returns how much of the journal the snapshot already covers.
+ */
+int load_snapshot(VaccineSystem *system, const char *path, long long *journal_offset) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 0;
+
+    struct stat info;
+    if (fstat(fd, &info) == -1 || (size_t)info.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return 0;
+    }
+    size_t size = info.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+
+    /* Every count is checked against the file size before anything is read or allocated */
+    const SnapshotHeader *header = (const SnapshotHeader *)data;
+    size_t expected = sizeof(SnapshotHeader) + header->vaccine_name_bytes +
+                      (size_t)header->batch_count * sizeof(VaccineBatch) +
+                      header->name_bytes + (size_t)header->inoculation_count * sizeof(Inoculation) +
+                      (size_t)header->expired_count * sizeof(VaccineBatch);
+    int ok = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+             header->version == SNAPSHOT_VERSION &&
+             header->batch_size == sizeof(VaccineBatch) &&
+             header->inoculation_size == sizeof(Inoculation) &&
+             size == expected &&
+             header->vaccine_count <= header->vaccine_name_bytes / 2 && // A character and a NUL at least
+             header->patient_count <= header->name_bytes &&              // A NUL at least, a patient can be ""
+             is_valid_day_number(header->current_date) &&
+             (system->store.limit == 0 || header->batch_count <= (unsigned)system->store.limit);
+
+    const char *cursor = data + sizeof(SnapshotHeader);
+    int *ids = ok ? malloc((header->patient_count + 1) * sizeof(int)) : NULL;
+    ok = ok && ids != NULL;
+
+    if (ok) {
+        system->current_date = header->current_date;
+        *journal_offset = header->journal_offset;
+    }
+
+    /* Interned in id order, each name gets back the id the records refer to */
+    const char *vaccine_names_end = cursor + (ok ? header->vaccine_name_bytes : 0);
+    for (unsigned i = 0; ok && i < header->vaccine_count; i++) {
+        const char *end = memchr(cursor, '\0', vaccine_names_end - cursor);
+        ok = end != NULL && end > cursor && intern_name(&system->vaccines, cursor) == (int)i;
+        cursor = ok ? end + 1 : cursor;
+    }
+    ok = ok && cursor == vaccine_names_end;
+
+    for (unsigned i = 0; ok && i < header->batch_count; i++, cursor += sizeof(VaccineBatch)) {
+        VaccineBatch batch;
+        memcpy(&batch, cursor, sizeof(VaccineBatch));
+        ok = is_valid_snapshot_batch(&batch, header->vaccine_count) && search_batch(system, batch.batch) == -1 &&
+             reserve_vaccine_heap(get_vaccine(system, batch.vaccine)) && insert_sorted(system, &batch) != -1 &&
+             push_vaccine_batch(system, &batch);
+    }
+    /* Expired batches stay listed, but are no longer dispensed */
+    for (int id = 0; ok && id < system->vaccines.count; id++) {
+        drop_expired_refs(system, intern_entry(&system->vaccines, id));
+    }
+
+    const char *names_end = cursor + (ok ? header->name_bytes : 0);
+    for (unsigned i = 0; ok && i < header->patient_count; i++) {
+        const char *end = memchr(cursor, '\0', names_end - cursor);
+        if (end == NULL) {
+            ok = 0;
+            break;
+        }
+        ids[i] = intern_name(&system->patients, cursor);
+        ok = ids[i] != -1;
+        cursor = end + 1;
+    }
+    ok = ok && cursor == names_end;
+
+    for (unsigned i = 0; ok && i < header->inoculation_count; i++, cursor += sizeof(Inoculation)) {
+        Inoculation inoculation;
+        memcpy(&inoculation, cursor, sizeof(Inoculation));
+        ok = inoculation.patient >= 0 && (unsigned)inoculation.patient < header->patient_count &&
+             inoculation.vaccine >= 0 && (unsigned)inoculation.vaccine < header->vaccine_count &&
+             is_valid_batch_key(inoculation.batch) && is_valid_day_number(inoculation.application_date);
+        if (ok) {
+            inoculation.patient = ids[inoculation.patient];
+            inoculation.deleted = 0;
+            ok = append_inoculation(system, &inoculation);
+        }
+    }
+
+    for (unsigned i = 0; ok && i < header->expired_count; i++, cursor += sizeof(VaccineBatch)) {
+        VaccineBatch batch;
+        memcpy(&batch, cursor, sizeof(VaccineBatch));
+        ok = is_valid_snapshot_batch(&batch, header->vaccine_count) && keep_expired(&system->expired, &batch);
+    }
+
+    free(ids);
+    munmap((void *)data, size);
+    return ok;
+}
+
+/*============================================ JOURNAL =============================================*/
+
+/* Commands that change the system: c, a, r, d and t with a date (a bare t only prints it) */
+int is_journaled(const char *line) {
+    if (line[0] == 't') {
+        for (const char *c = line + 1; *c != '\0'; c++) {
+            if (!isspace((unsigned char)*c)) return 1;
+        }
+        return 0;
+    }
+    return line[0] == 'c' || line[0] == 'a' || line[0] == 'r' || line[0] == 'd';
+}
+
+/**
+ * Opens the journal for appending, cutting it at the given offset so that a
+ * command left half-written by a crash is dropped.
+ */
+int open_journal(Journal *journal, const char *path, long long offset) {
+    journal->fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (journal->fd == -1) return 0;
+
+    journal->buffer = malloc(JOURNAL_BUFFER_SIZE);
+    if (!journal->buffer || ftruncate(journal->fd, offset) == -1 || lseek(journal->fd, offset, SEEK_SET) == -1) {
+        close_journal(journal);
+        return 0;
+    }
+    journal->offset = offset;
+    journal->used = 0;
+    journal->dirty = 0;
+    return 1;
+}
+
+/* Writes a failure of the journal off as fatal: commands must not run unjournaled */
+void journal_failed(void) {
+    fprintf(stderr, "%s\n", EJOURNAL);
+    exit(1);
+}
+
+/* Hands the buffered entries to the kernel; they are durable after the next commit */
+void write_journal(Journal *journal) {
+    size_t written = 0;
+    while (written < journal->used) {
+        ssize_t bytes = write(journal->fd, journal->buffer + written, journal->used - written);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) journal_failed();
+        written += bytes;
+    }
+    journal->offset += journal->used;
+    journal->used = 0;
+}
+
+/* Appends a command line to the journal, ahead of running it */
+void journal_command(Journal *journal, const char *line, size_t length) {
+    if (journal->used + length + 1 > JOURNAL_BUFFER_SIZE) {
+        write_journal(journal);
+        if (length + 1 > JOURNAL_BUFFER_SIZE) journal_failed(); // Longer than any valid command
+    }
+    memcpy(journal->buffer + journal->used, line, length);
+    journal->buffer[journal->used + length] = '\n';
+    journal->used += length + 1;
+    journal->entries++;
+    journal->dirty = 1;
+}
+
+/**
+ * Group commit: every command journaled since the last commit is made
+ * durable with a single fsync. Runs before any output is written, so no
+ * answer is ever seen for a command that could be lost.
+ */
+void commit_journal(Journal *journal) {
+    if (!journal->dirty) return;
+    write_journal(journal);
+    if (fdatasync(journal->fd) == -1) journal_failed();
+    journal->dirty = 0;
+    journal->commits++;
+}
+
+void close_journal(Journal *journal) {
+    if (journal->fd == -1) return;
+    if (journal->buffer != NULL) commit_journal(journal);
+    close(journal->fd);
+    free(journal->buffer);
+    journal->fd = -1;
+    journal->buffer = NULL;
+}
+
+/**
+ * Runs the commands the journal holds past the given offset, printing
+ * nothing. A last line without its newline was cut short by a crash and is
+ * ignored. Returns where the complete commands end, or -1 on failure.
+ */
+long long replay_journal(VaccineSystem *system, const char *path, long long offset) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return errno == ENOENT && offset == 0 ? 0 : -1;
+
+    struct stat info;
+    FILE *stream = fstat(fd, &info) == 0 && info.st_size >= offset ? fdopen(fd, "r") : NULL;
+    InputReader reader;
+    if (stream == NULL || lseek(fd, offset, SEEK_SET) == -1 ||
+        !init_input_reader(&reader, stream, &system->output)) {
+        if (stream != NULL) fclose(stream);
+        else close(fd);
+        return -1;
+    }
+
+    FILE *output_stream = system->output.stream;
+    system->output.stream = NULL;
+
+    long long end = offset;
+    int has_newline;
+    size_t length;
+    char *line;
+    Command command;
+
+    while ((line = next_line(&reader, &length, &has_newline)) != NULL && has_newline) {
+        if (!tokenize_command(&reader, line, has_newline, &command)) {
+            end = -1;
+            break;
+        }
+        run_command(system, &command, 0);
+        end += length + 1;
+    }
+
+    flush_output(&system->output);
+    system->output.stream = output_stream;
+    free_input_reader(&reader);
+    fclose(stream);
+    return end;
+}
+
+/*============================================ PIPELINE ============================================*/
+
+int init_ring(Ring *ring, unsigned capacity) {
+    ring->slots = malloc(capacity * sizeof(void *));
+    ring->capacity = capacity;
+    ring->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPINS : 0;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->consumer_parked, 0);
+    atomic_init(&ring->producer_parked, 0);
+    return ring->slots != NULL && sem_init(&ring->filled, 0, 0) == 0 && sem_init(&ring->free, 0, 0) == 0;
+}
+
+/* Waits for a free slot if the ring is full */
+void ring_push(Ring *ring, void *item) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == ring->capacity) {
+        ring_wait(&ring->head, tail - ring->capacity, ring->spins, &ring->producer_parked, &ring->free);
+    }
+    ring->slots[tail % ring->capacity] = item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    ring_wake(&ring->consumer_parked, &ring->filled);
+}
+
+/* Waits for an item if the ring is empty */
+void *ring_pop(Ring *ring) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+        ring_wait(&ring->tail, head, ring->spins, &ring->consumer_parked, &ring->filled);
+    }
+    void *item = ring->slots[head % ring->capacity];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    ring_wake(&ring->producer_parked, &ring->free);
+    return item;
+}
+
+/* Returns NULL instead of waiting if the ring is empty */
+void *ring_try_pop(Ring *ring) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) return NULL;
+    void *item = ring->slots[head % ring->capacity];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    ring_wake(&ring->producer_parked, &ring->free);
+    return item;
+}
+
+/**
+ * Waits until the other side moves the index off value: spins first, as
+ * the other side is usually about to, then parks. Raising the flag before
+ * the last look at the index, against ring_wake's look at the flag after
+ * its store, means one of the two always sees the other.
+ */
+void ring_wait(atomic_uint *index, unsigned value, int spins, atomic_int *parked, sem_t *wake) {
+    for (int spin = 0; spin < spins; spin++) {
+        if (atomic_load_explicit(index, memory_order_acquire) != value) return;
+#ifdef __SSE2__
+        _mm_pause();
+#endif
+    }
+    while (1) {
+        atomic_store(parked, 1);
+        if (atomic_load(index) == value || !atomic_exchange(parked, 0)) {
+            /* Still nothing, or a wake is already on its way: take the post */
+            while (sem_wait(wake) == -1) {
+                // Interrupted, wait again
+            }
+        }
+        if (atomic_load_explicit(index, memory_order_acquire) != value) return;
+    }
+}
+
+/* Posts the other side's semaphore only if it parked, after an index store */
+void ring_wake(atomic_int *parked, sem_t *wake) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(parked, memory_order_relaxed) && atomic_exchange(parked, 0)) {
+        sem_post(wake);
+    }
+}
+
+void free_ring(Ring *ring) {
+    free(ring->slots);
+    sem_destroy(&ring->filled);
+    sem_destroy(&ring->free);
+}
+
+int init_command_batch(CommandBatch *batch) {
+    batch->text = malloc(INPUT_BLOCK_SIZE + 1); // Room for the longest line the reader hands out
+    batch->commands = malloc(BATCH_COMMANDS * sizeof(Command));
+    batch->first_args = malloc(BATCH_COMMANDS * sizeof(int));
+    batch->args_capacity = BATCH_COMMANDS;
+    batch->args = malloc(batch->args_capacity * sizeof(Token));
+    clear_command_batch(batch);
+    return batch->text != NULL && batch->commands != NULL && batch->first_args != NULL && batch->args != NULL;
+}
+
+void clear_command_batch(CommandBatch *batch) {
+    batch->text_used = 0;
+    batch->count = 0;
+    batch->args_used = 0;
+    batch->last = 0;
+}
+
+/* Copies the arguments of the batch's last command out of the reader's storage */
+int keep_command_args(CommandBatch *batch, Command *command) {
+    if (batch->args_used + command->argc > batch->args_capacity) {
+        int capacity = batch->args_capacity * 2 + command->argc;
+        Token *args = realloc(batch->args, capacity * sizeof(Token));
+        if (!args) return 0;
+        batch->args = args;
+        batch->args_capacity = capacity;
+    }
+    memcpy(batch->args + batch->args_used, command->args, command->argc * sizeof(Token));
+    batch->first_args[batch->count - 1] = batch->args_used;
+    batch->args_used += command->argc;
+    return 1;
+}
+
+void free_command_batch(CommandBatch *batch) {
+    free(batch->text);
+    free(batch->commands);
+    free(batch->first_args);
+    free(batch->args);
+}
+
+/**
+ * Sets up the rings, moves the output onto chunks for the writer thread and
+ * starts the parser and writer threads; the calling thread is the executor.
+ */
+int start_pipeline(Pipeline *pipeline, VaccineSystem *system, InputReader *reader, int reader_count) {
+    OutputBuffer *out = &system->output;
+    pipeline->reader = reader;
+    pipeline->journal = reader->journal;
+    pipeline->stream = out->stream;
+
+    if (!init_ring(&pipeline->batches, PIPELINE_BATCHES) || !init_ring(&pipeline->free_batches, PIPELINE_BATCHES) ||
+        !init_ring(&pipeline->chunks, PIPELINE_CHUNKS) || !init_ring(&pipeline->free_chunks, PIPELINE_CHUNKS)) {
+        return 0;
+    }
+    for (int i = 0; i < PIPELINE_BATCHES; i++) {
+        if (!init_command_batch(&pipeline->batch_pool[i])) return 0;
+        ring_push(&pipeline->free_batches, &pipeline->batch_pool[i]);
+    }
+    /* The first chunk is the buffer the output already has */
+    pipeline->chunk_pool[0].bytes = out->buffer;
+    pipeline->chunk_pool[0].job = NULL;
+    for (int i = 1; i < PIPELINE_CHUNKS; i++) {
+        pipeline->chunk_pool[i].bytes = malloc(OUTPUT_BUFFER_SIZE);
+        pipeline->chunk_pool[i].job = NULL;
+        if (!pipeline->chunk_pool[i].bytes) return 0;
+        ring_push(&pipeline->free_chunks, &pipeline->chunk_pool[i]);
+    }
+    pipeline->readers.count = 0;
+    if (reader_count > 0) {
+        if (!start_readers(&pipeline->readers, reader_count)) return 0;
+        system->readers = &pipeline->readers;
+    }
+    out->chunk = &pipeline->chunk_pool[0];
+    out->chunks = &pipeline->chunks;
+    out->free_chunks = &pipeline->free_chunks;
+
+    /* The parser commits the journal before handing commands over, so before any output */
+    out->journal = NULL;
+    reader->output = NULL;
+    reader->pause_before_read = 1;
+
+    return pthread_create(&pipeline->parser, NULL, parser_thread, pipeline) == 0 &&
+           pthread_create(&pipeline->writer, NULL, writer_thread, pipeline) == 0;
+}
+
+/**
+ * Reads, journals and tokenizes the input into batches. A batch is handed
+ * over when it is full, when no more input is available without blocking,
+ * and at the end of the input or after a q.
+ */
+void *parser_thread(void *argument) {
+    Pipeline *pipeline = argument;
+    InputReader *reader = pipeline->reader;
+    CommandBatch *batch = ring_pop(&pipeline->free_batches);
+    int has_newline;
+    size_t length;
+    char *line;
+
+    while ((line = next_line(reader, &length, &has_newline)) != NULL || reader->paused) {
+        if (line == NULL) {
+            if (batch->count > 0) batch = send_batch(pipeline, batch, 0);
+            continue;
+        }
+        if (batch->count == BATCH_COMMANDS || batch->text_used + length + 1 > INPUT_BLOCK_SIZE + 1) {
+            batch = send_batch(pipeline, batch, 0);
+        }
+
+        /* The line moves into the batch, since the reader reuses its buffer */
+        char *text = batch->text + batch->text_used;
+        memcpy(text, line, length + 1);
+        batch->text_used += length + 1;
+
+        Command *command = &batch->commands[batch->count++];
+        parse_command(reader, text, length, has_newline, command);
+        if (!keep_command_args(batch, command)) {
+            command->name = '\0';
+            command->argc = 0;
+            command->error = "Memory allocation error";
+        }
+        if (command->name == 'q') break;
+    }
+
+    send_batch(pipeline, batch, 1);
+    return NULL;
+}
+
+/* Hands a batch to the executor once its commands are durable, returning an empty one */
+CommandBatch *send_batch(Pipeline *pipeline, CommandBatch *batch, int last) {
+    if (pipeline->journal != NULL) commit_journal(pipeline->journal);
+
+    for (int i = 0; i < batch->count; i++) {
+        batch->commands[i].args = batch->args + batch->first_args[i];
+    }
+    batch->last = last;
+    ring_push(&pipeline->batches, batch);
+    if (last) return NULL;
+
+    batch = ring_pop(&pipeline->free_batches);
+    clear_command_batch(batch);
+    return batch;
+}
+
+/* Runs the batches in order, returning 1 if the input ended with q */
+int execute_batches(Pipeline *pipeline, VaccineSystem *system, int lang_pt) {
+    int quit = 0, last = 0;
+
+    while (!last) {
+        CommandBatch *batch = ring_pop(&pipeline->batches);
+        for (int i = 0; i < batch->count; i++) {
+            Command *command = &batch->commands[i];
+            if (command->error != NULL) {
+                write_line(&system->output, command->error);
+            }
+            if (command->name == 'q') {
+                quit = 1;
+                break;
+            }
+            run_command(system, command, lang_pt);
+        }
+        last = batch->last;
+        ring_push(&pipeline->free_batches, batch);
+
+        /* Answers go out batch by batch, so lines typed one at a time are answered */
+        flush_output(&system->output);
+    }
+    return quit;
+}
+
+void *writer_thread(void *argument) {
+    Pipeline *pipeline = argument;
+    OutputChunk *chunk;
+
+    while ((chunk = ring_pop(&pipeline->chunks)) != NULL) {
+        fwrite(chunk->bytes, 1, chunk->used, pipeline->stream);
+        if (chunk->job != NULL) {
+            write_read_job(&pipeline->readers, chunk->job, pipeline->stream);
+            chunk->job = NULL;
+        }
+        fflush(pipeline->stream);
+        ring_push(&pipeline->free_chunks, chunk);
+    }
+    return NULL;
+}
+
+/**
+ * Waits for the writer to write out everything, readers' output included,
+ * and for the parser to end, then frees the pipeline. The output keeps its
+ * last chunk as its buffer.
+ */
+void stop_pipeline(Pipeline *pipeline, VaccineSystem *system) {
+    OutputBuffer *out = &system->output;
+    flush_output(out);
+    ring_push(&pipeline->chunks, NULL);
+    pthread_join(pipeline->writer, NULL);
+    pthread_join(pipeline->parser, NULL);
+    if (pipeline->readers.count > 0) stop_readers(&pipeline->readers);
+    system->readers = NULL;
+
+    for (int i = 0; i < PIPELINE_CHUNKS; i++) {
+        if (&pipeline->chunk_pool[i] != out->chunk) free(pipeline->chunk_pool[i].bytes);
+    }
+    out->chunk = NULL;
+    out->chunks = NULL;
+    out->free_chunks = NULL;
+
+    for (int i = 0; i < PIPELINE_BATCHES; i++) {
+        free_command_batch(&pipeline->batch_pool[i]);
+    }
+    free_ring(&pipeline->batches);
+    free_ring(&pipeline->free_batches);
+    free_ring(&pipeline->chunks);
+    free_ring(&pipeline->free_chunks);
+}
+
+/*============================================= SERVER =============================================*/
+
+/**
+ * Serves the commands on a socket until SIGINT or SIGTERM. The lines of
+ * each client run as they arrive, one at a time, against the shared
+ * system, and their answers go back to that client only; q closes the
+ * client. Returns 0 if the socket could not be set up.
+ */
+int serve(VaccineSystem *system, InputReader *reader, const char *address, int lang_pt) {
+    Server server = {-1, -1, -1, NULL, reader, lang_pt, NULL};
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) == -1 ||
+        (server.signal_fd = signalfd(-1, &signals, 0)) == -1 ||
+        (server.epoll_fd = epoll_create1(0)) == -1 ||
+        !open_listener(&server, address) ||
+        !watch_fd(&server, server.listen_fd, &server.listen_fd) ||
+        !watch_fd(&server, server.signal_fd, &server.signal_fd)) {
+        stop_server(&server);
+        return 0;
+    }
+
+    struct epoll_event events[SERVER_EVENTS];
+    int running = 1;
+    while (running) {
+        int count = epoll_wait(server.epoll_fd, events, SERVER_EVENTS, -1);
+        if (count == -1 && errno != EINTR) break;
+
+        /* epoll reports each descriptor once per wait, so a connection can be closed as it is handled */
+        for (int i = 0; i < count; i++) {
+            void *data = events[i].data.ptr;
+            if (data == &server.listen_fd) {
+                accept_connections(&server);
+            } else if (data == &server.signal_fd) {
+                running = 0;
+            } else {
+                Connection *connection = data;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) receive_input(&server, system, connection);
+                if (events[i].events & EPOLLOUT) send_output(connection);
+                watch_connection(&server, connection);
+            }
+        }
+    }
+
+    stop_server(&server);
+    return 1;
+}
+
+/* A Unix socket at the given path, or a TCP socket on 127.0.0.1 if the address is a port number */
+int open_listener(Server *server, const char *address) {
+    char *end;
+    long port = strtol(address, &end, 10);
+
+    if (*address != '\0' && *end == '\0') {
+        struct sockaddr_in in = {0};
+        int reuse = 1;
+        if (port <= 0 || port > 65535) return 0;
+        in.sin_family = AF_INET;
+        in.sin_port = htons(port);
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server->listen_fd == -1 ||
+            setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+            bind(server->listen_fd, (struct sockaddr *)&in, sizeof(in)) == -1) {
+            return 0;
+        }
+    } else {
+        struct sockaddr_un un = {0};
+        struct stat info;
+        if (strlen(address) >= sizeof(un.sun_path)) return 0;
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, address);
+        /* A socket left behind by a server that did not stop cleanly, but nothing else */
+        if (stat(address, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(address);
+        server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server->listen_fd == -1 || bind(server->listen_fd, (struct sockaddr *)&un, sizeof(un)) == -1) {
+            return 0;
+        }
+        server->socket_path = address;
+    }
+    return listen(server->listen_fd, LISTEN_BACKLOG) == 0 && fcntl(server->listen_fd, F_SETFL, O_NONBLOCK) == 0;
+}
+
+/* Starts watching a descriptor for input, with data identifying it in the events */
+int watch_fd(Server *server, int fd, void *data) {
+    struct epoll_event event = {EPOLLIN, {.ptr = data}};
+    return epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void accept_connections(Server *server) {
+    int fd, no_delay = 1;
+
+    while ((fd = accept(server->listen_fd, NULL, NULL)) != -1) {
+        Connection *connection = calloc(1, sizeof(Connection));
+        if (connection != NULL) connection->input = malloc(CONNECTION_INPUT_INITIAL + 1);
+        if (connection == NULL || connection->input == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+            !watch_fd(server, fd, connection)) {
+            if (connection != NULL) free(connection->input);
+            free(connection);
+            close(fd);
+            continue;
+        }
+        /* Answers are small and awaited, so they leave at once */
+        if (server->socket_path == NULL) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+        connection->fd = fd;
+        connection->lang_pt = server->lang_pt;
+        connection->input_capacity = CONNECTION_INPUT_INITIAL;
+        connection->events = EPOLLIN;
+        connection->next = server->connections;
+        if (server->connections != NULL) server->connections->prev = connection;
+        server->connections = connection;
+    }
+}
+
+/* Closes a connection that is done, or else watches it for what it can do next */
+void watch_connection(Server *server, Connection *connection) {
+    size_t unsent = connection->pending.used - connection->pending.sent;
+    if (connection->failed || connection->pending.failed || (connection->closing && unsent == 0)) {
+        close_connection(server, connection);
+        return;
+    }
+
+    /* A client that is not reading its answers is not read either */
+    struct epoll_event event = {0, {.ptr = connection}};
+    if (!connection->closing && unsent < CONNECTION_OUTPUT_LIMIT) event.events |= EPOLLIN;
+    if (unsent > 0) event.events |= EPOLLOUT;
+    if (event.events != connection->events) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->events = event.events;
+    }
+}
+
+void close_connection(Server *server, Connection *connection) {
+    close(connection->fd); // Also takes it out of the epoll set
+    if (connection->prev != NULL) connection->prev->next = connection->next;
+    else server->connections = connection->next;
+    if (connection->next != NULL) connection->next->prev = connection->prev;
+    free(connection->input);
+    free(connection->pending.bytes);
+    free(connection);
+}
+
+/**
+ * Reads what the client sent and runs each complete line, like the lines
+ * of the standard input: a line longer than a whole block, or the last one
+ * when the client stops sending, is run without its newline.
+ */
+void receive_input(Server *server, VaccineSystem *system, Connection *connection) {
+    if (connection->closing) return;
+
+    if (connection->input_used == connection->input_capacity) {
+        size_t capacity = connection->input_capacity * 2;
+        if (capacity > INPUT_BLOCK_SIZE) capacity = INPUT_BLOCK_SIZE;
+        char *input = realloc(connection->input, capacity + 1); // Room to terminate a line
+        if (!input) {
+            connection->failed = 1;
+            return;
+        }
+        connection->input = input;
+        connection->input_capacity = capacity;
+    }
+
+    ssize_t bytes = read(connection->fd, connection->input + connection->input_used,
+                         connection->input_capacity - connection->input_used);
+    if (bytes < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) connection->failed = 1;
+        return;
+    }
+    int eof = bytes == 0;
+    connection->input_used += bytes;
+
+    system->output.pending = &connection->pending;
+    size_t start = 0;
+    while (!connection->closing) {
+        char *begin = connection->input + start;
+        size_t pending = connection->input_used - start;
+        char *newline = memchr(begin, '\n', pending);
+        size_t length;
+
+        if (newline != NULL) length = newline - begin;
+        else if ((eof && pending > 0) || pending == INPUT_BLOCK_SIZE) length = pending;
+        else break;
+
+        begin[length] = '\0';
+        start += length + (newline != NULL);
+        run_client_line(server, system, connection, begin, length, newline != NULL);
+    }
+    if (eof) connection->closing = 1;
+
+    /* The answers go out once the commands are journaled, like flushes to stdout */
+    flush_output(&system->output);
+    system->output.pending = NULL;
+
+    memmove(connection->input, connection->input + start, connection->input_used - start);
+    connection->input_used -= start;
+    send_output(connection);
+}
+
+/**
+ * Runs one line of a client, in the client's own language. Clients cannot
+ * write snapshots, which would let them write any file the server can.
+ */
+void run_client_line(Server *server, VaccineSystem *system, Connection *connection,
+                     char *line, size_t length, int has_newline) {
+    if (strcmp(line, "pt") == 0 || strcmp(line, "en") == 0) {
+        connection->lang_pt = line[0] == 'p';
+        return;
+    }
+
+    Command command;
+    parse_command(server->reader, line, length, has_newline, &command);
+    if (command.error != NULL) {
+        write_line(&system->output, command.error);
+    }
+    if (command.name == 'q') {
+        connection->closing = 1;
+        return;
+    }
+    if (command.name == 'w') {
+        write_line(&system->output, connection->lang_pt ? ENOTALLOWEDPT : ENOTALLOWED);
+        return;
+    }
+    run_command(system, &command, connection->lang_pt);
+}
+
+/* Appends output, to be passed on later by the owner of the pending output */
+void queue_output(PendingOutput *pending, const char *bytes, size_t size) {
+    if (size == 0) return;
+    if (pending->sent > 0) {
+        pending->used -= pending->sent;
+        memmove(pending->bytes, pending->bytes + pending->sent, pending->used);
+        pending->sent = 0;
+    }
+    if (pending->used + size > pending->capacity) {
+        size_t capacity = pending->capacity ? pending->capacity : OUTPUT_BUFFER_SIZE;
+        while (capacity < pending->used + size) capacity *= 2;
+        char *bytes = realloc(pending->bytes, capacity);
+        if (!bytes) {
+            pending->failed = 1;
+            return;
+        }
+        pending->bytes = bytes;
+        pending->capacity = capacity;
+    }
+    memcpy(pending->bytes + pending->used, bytes, size);
+    pending->used += size;
+}
+
+/* Sends as much of the pending output as the socket takes without blocking */
+void send_output(Connection *connection) {
+    PendingOutput *pending = &connection->pending;
+    while (pending->sent < pending->used) {
+        ssize_t bytes = send(connection->fd, pending->bytes + pending->sent, pending->used - pending->sent, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) connection->failed = 1;
+            return;
+        }
+        pending->sent += bytes;
+    }
+    pending->sent = 0;
+    pending->used = 0;
+}
+
+/* Closes every client and the server's own descriptors */
+void stop_server(Server *server) {
+    while (server->connections != NULL) {
+        send_output(server->connections); // Whatever the socket still takes
+        close_connection(server, server->connections);
+    }
+    if (server->listen_fd != -1) close(server->listen_fd);
+    if (server->signal_fd != -1) close(server->signal_fd);
+    if (server->epoll_fd != -1) close(server->epoll_fd);
+    if (server->socket_path != NULL) unlink(server->socket_path);
+}
+
+/*============================================= READERS ============================================*/
+
+int start_readers(ReaderPool *readers, int count) {
+    readers->count = count;
+    readers->next = 0;
+    readers->spare = NULL;
+    readers->started = 0;
+    atomic_init(&readers->finished, 0);
+    if (!init_ring(&readers->free_jobs, READ_JOBS)) return 0;
+
+    for (int j = 0; j < READ_JOBS; j++) {
+        ReadJob *job = &readers->job_pool[j];
+        memset(job, 0, sizeof(ReadJob));
+        if (!init_ring(&job->output, READ_JOB_CHUNKS) || !init_ring(&job->free_output, READ_JOB_CHUNKS)) return 0;
+        for (int c = 0; c < READ_JOB_CHUNKS; c++) {
+            job->chunk_pool[c].bytes = malloc(OUTPUT_BUFFER_SIZE);
+            if (!job->chunk_pool[c].bytes) return 0;
+            ring_push(&job->free_output, &job->chunk_pool[c]);
+        }
+        ring_push(&readers->free_jobs, job);
+    }
+
+    /* Room for every job and the NULL that stops the reader */
+    for (int i = 0; i < count; i++) {
+        if (!init_ring(&readers->jobs[i], READ_JOBS + 1) ||
+            pthread_create(&readers->threads[i], NULL, reader_thread, &readers->jobs[i]) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Whether a reader may still be reading the log in place */
+int readers_out(ReaderPool *readers) {
+    return readers->started != atomic_load(&readers->finished);
+}
+
+/**
+ * Hands a whole l or u to a reader thread along with its snapshot,
+ * marking its place in the output. Returns 0 if the command must run here
+ * instead: every job is out, or the snapshot could not be taken.
+ */
+int start_read(VaccineSystem *system, Command *command, int lang_pt) {
+    ReaderPool *readers = system->readers;
+    ReadJob *job = readers->spare != NULL ? readers->spare : ring_try_pop(&readers->free_jobs);
+    readers->spare = NULL;
+    if (job == NULL) return 0;
+
+    int ok = copy_command(&job->copy, command) &&
+             (command->name == 'l' ? snapshot_batches(system, job) : snapshot_log(system, job));
+    if (!ok) {
+        readers->spare = job;
+        return 0;
+    }
+    job->lang_pt = lang_pt;
+
+    if (command->name == 'u') record_scan(&system->stats.record_scans, system->log.size);
+
+    /* The writer moves on to the job's output once it reaches this point */
+    system->output.chunk->job = job;
+    hand_output(&system->output);
+    readers->started++;
+    ring_push(&readers->jobs[readers->next], job);
+    readers->next = (readers->next + 1) % readers->count;
+    return 1;
+}
+
+/* Copies the name of each id of a table, whose array may be reallocated meanwhile (the names never move) */
+int copy_names(InternTable *table, char ***names, int *capacity) {
+    if (table->count > *capacity) {
+        char **copy = realloc(*names, table->count * sizeof(char *));
+        if (!copy) return 0;
+        *names = copy;
+        *capacity = table->count;
+    }
+    if (table->count > 0) memcpy(*names, table->names, table->count * sizeof(char *));
+    return 1;
+}
+
+/* l: copies the live batches in list order, as their doses keep changing */
+int snapshot_batches(VaccineSystem *system, ReadJob *job) {
+    if (!copy_names(&system->vaccines, &job->vaccine_names, &job->vaccine_names_capacity)) return 0;
+
+    int count = system->store.count;
+    if (count > job->batches_capacity) {
+        VaccineBatch *batches = realloc(job->batches, count * sizeof(VaccineBatch));
+        if (!batches) return 0;
+        job->batches = batches;
+        job->batches_capacity = count;
+    }
+    for (int i = 0; i < count; i++) {
+        job->batches[i] = load_batch(&system->store, system->store.order[i]);
+    }
+    job->batch_count = count;
+    return 1;
+}
+
+/**
+ * u: records are only appended, and deleted ones keep their place until a
+ * compaction, so the log is read in place up to its current size. Only the
+ * arrays that may be reallocated meanwhile are copied.
+ */
+int snapshot_log(VaccineSystem *system, ReadJob *job) {
+    InoculationLog *log = &system->log;
+
+    if (log->chunk_count > job->chunks_capacity) {
+        Inoculation **chunks = realloc(job->chunks, log->chunk_count * sizeof(Inoculation *));
+        if (!chunks) return 0;
+        job->chunks = chunks;
+        job->chunks_capacity = log->chunk_count;
+    }
+    if (!copy_names(&system->patients, &job->patient_names, &job->names_capacity)) return 0;
+
+    if (log->chunk_count > 0) memcpy(job->chunks, log->chunks, log->chunk_count * sizeof(Inoculation *));
+    job->size = log->size;
+    job->deletions = system->deletions;
+    return 1;
+}
+
+void *reader_thread(void *argument) {
+    Ring *jobs = argument;
+    ReadJob *job;
+
+    while ((job = ring_pop(jobs)) != NULL) {
+        run_read_job(job);
+    }
+    return NULL;
+}
+
+/* Lists what the job's snapshot holds, exactly as l or u would */
+void run_read_job(ReadJob *job) {
+    Command *command = &job->copy.command;
+    OutputBuffer out;
+    out.stream = NULL;
+    out.journal = NULL;
+    out.pending = NULL;
+    out.chunks = &job->output;
+    out.free_chunks = &job->free_output;
+    out.chunk = ring_pop(&job->free_output);
+    out.buffer = out.chunk->bytes;
+    out.used = 0;
+
+    if (command->name == 'u') {
+        for (int pos = 0; pos < job->size; pos++) {
+            Inoculation *inoculation = &job->chunks[pos / INOCULATION_CHUNK_SIZE][pos % INOCULATION_CHUNK_SIZE];
+            int deleted = atomic_load_explicit(&inoculation->deleted, memory_order_relaxed);
+            if (deleted == 0 || deleted > job->deletions) print_inoculation(&out, job->patient_names, inoculation);
+        }
+    } else {
+        for (int i = 0; i < job->batch_count; i++) {
+            print_batch(&out, job->vaccine_names, &job->batches[i]);
+        }
+    }
+
+    /* The last chunk, empty or not, tells the writer the output is complete */
+    out.chunk->used = out.used;
+    out.chunk->job = job;
+    ring_push(&job->output, out.chunk);
+}
+
+/* Writes a reader's output as it comes, then gives the job back to the executor */
+void write_read_job(ReaderPool *readers, ReadJob *job, FILE *stream) {
+    int last;
+    do {
+        OutputChunk *chunk = ring_pop(&job->output);
+        fwrite(chunk->bytes, 1, chunk->used, stream);
+        last = chunk->job != NULL;
+        chunk->job = NULL;
+        ring_push(&job->free_output, chunk);
+    } while (!last);
+
+    atomic_fetch_add(&readers->finished, 1);
+    ring_push(&readers->free_jobs, job);
+}
+
+/* Stops the readers once the writer has written every job */
+void stop_readers(ReaderPool *readers) {
+    for (int i = 0; i < readers->count; i++) {
+        ring_push(&readers->jobs[i], NULL);
+        pthread_join(readers->threads[i], NULL);
+        free_ring(&readers->jobs[i]);
+    }
+    for (int j = 0; j < READ_JOBS; j++) {
+        ReadJob *job = &readers->job_pool[j];
+        for (int c = 0; c < READ_JOB_CHUNKS; c++) {
+            free(job->chunk_pool[c].bytes);
+        }
+        free_ring(&job->output);
+        free_ring(&job->free_output);
+        free_command_copy(&job->copy);
+        free(job->batches);
+        free(job->chunks);
+        free(job->patient_names);
+        free(job->vaccine_names);
+    }
+    free_ring(&readers->free_jobs);
+}
+
+/*============================================== SITES =============================================*/
+
+/**
+ * Starts the workers, which wait for shards to be scheduled. The calling
+ * thread is the dispatcher: it reads the input, creates the shards as
+ * their sites first appear and writes out the answers.
+ */
+int start_sites(Sites *sites, int worker_count, int max_batches, int lang_pt) {
+    sites->max_batches = max_batches;
+    sites->lang_pt = lang_pt;
+    sites->worker_count = worker_count;
+    sites->dispatched = 0;
+    sites->emitted = 0;
+    atomic_init(&sites->stopping, 0);
+    sites->tasks = calloc(SITE_TASKS, sizeof(SiteTask));
+
+    if (!sites->tasks || !init_intern_table(&sites->names, sizeof(Shard *)) || !init_shard_deque(&sites->injected) ||
+        sem_init(&sites->ready, 0, 0) != 0 || sem_init(&sites->completed, 0, 0) != 0) {
+        return 0;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        sites->workers[i].sites = sites;
+        sites->workers[i].id = i;
+        if (!init_shard_deque(&sites->workers[i].deque)) return 0;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&sites->workers[i].thread, NULL, site_worker, &sites->workers[i]) != 0) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Routes each line to the site its "@<site>" prefix names, or to the
+ * default site, and writes out the answers in input order. The queries
+ * over every site, "@* l" and "@* u", run here once all sites have caught
+ * up. Returns 1 if the input ended with q, from any site.
+ */
+int run_sites(Sites *sites, InputReader *reader, OutputBuffer *out) {
+    int has_newline, quit = 0;
+    size_t length;
+    char *line;
+    Command command;
+
+    /* Whatever answers the lines so far is written out here before blocking on a read */
+    reader->output = NULL;
+    reader->pause_before_read = 1;
+
+    while (!quit && ((line = next_line(reader, &length, &has_newline)) != NULL || reader->paused)) {
+        if (line == NULL) {
+            emit_site_tasks(sites, out, sites->dispatched, 1);
+            flush_output(out);
+            continue;
+        }
+
+        const char *site = DEFAULT_SITE;
+        if (line[0] == SITE_PREFIX) {
+            /* The site's name follows the prefix right away */
+            char *cursor = line + 1;
+            Token name = next_word(&cursor);
+            if (name.text != line + 1 || name.length == 0 || name.length > MAX_NAME_LENGTH) {
+                site_error(sites, out, sites->lang_pt ? EINVALIDPT : EINVALID);
+                continue;
+            }
+            while (isspace((unsigned char)*cursor)) cursor++;
+            length -= cursor - line;
+            line = cursor;
+            site = name.text;
+        }
+        parse_command(reader, line, length, has_newline, &command);
+
+        /* A query over every site sees each of them as of this line */
+        if (strcmp(site, ALL_SITES) == 0) {
+            emit_site_tasks(sites, out, sites->dispatched, 1);
+            if (command.error != NULL) write_line(out, command.error);
+            if (command.name == 'q') quit = 1;
+            else if (command.name == 'l') list_all_sites(sites, out, &command);
+            else if (command.name == 'u') inoculations_of_all_sites(sites, out, &command);
+            else if (command.name == 'e') expired_of_all_sites(sites, out);
+            else write_line(out, sites->lang_pt ? EINVALIDPT : EINVALID);
+            continue;
+        }
+        if (command.name == 'q') {
+            quit = 1;
+            continue;
+        }
+
+        Shard *shard = find_shard(sites, site);
+        if (shard == NULL) {
+            site_error(sites, out, sites->names.count < MAX_SITES ? "Memory allocation error" :
+                                   sites->lang_pt ? ETOOMANYSITESPT : ETOOMANYSITES);
+            continue;
+        }
+        dispatch_site_task(sites, out, shard, &command);
+    }
+
+    emit_site_tasks(sites, out, sites->dispatched, 1);
+    return quit;
+}
+
+/* Returns the shard of a site, created empty the first time, or NULL if it cannot be */
+Shard *find_shard(Sites *sites, const char *name) {
+    int id = intern_lookup(&sites->names, name);
+    if (id != -1) return *(Shard **)intern_entry(&sites->names, id);
+    if (sites->names.count == MAX_SITES) return NULL;
+
+    Shard *shard = malloc(sizeof(Shard));
+    if (shard == NULL || !init_vaccine_system(&shard->system, NULL, sites->max_batches) ||
+        !init_ring(&shard->tasks, SHARD_TASKS) || (id = intern_name(&sites->names, name)) == -1) {
+        free(shard);
+        return NULL;
+    }
+    shard->id = id;
+    atomic_init(&shard->queued, 0);
+    atomic_init(&shard->scheduled, 0);
+    *(Shard **)intern_entry(&sites->names, id) = shard;
+    return shard;
+}
+
+/**
+ * Queues a copy of the command for its shard, scheduling the shard if no
+ * worker holds it. Waits for the oldest task to be written out if every
+ * task is in flight, or for the shard's worker if its queue is full.
+ */
+void dispatch_site_task(Sites *sites, OutputBuffer *out, Shard *shard, Command *command) {
+    if (sites->dispatched - sites->emitted == SITE_TASKS) {
+        emit_site_tasks(sites, out, sites->emitted + 1, 1);
+    }
+
+    SiteTask *task = &sites->tasks[sites->dispatched % SITE_TASKS];
+    if (!copy_command(&task->copy, command)) {
+        site_error(sites, out, "Memory allocation error");
+        return;
+    }
+    task->shard = shard;
+    atomic_store_explicit(&task->done, 0, memory_order_relaxed);
+    sites->dispatched++;
+
+    /* Queued before the flag is checked, as the worker clears the flag before checking the queue */
+    ring_push(&shard->tasks, task);
+    atomic_fetch_add(&shard->queued, 1);
+    if (!atomic_exchange(&shard->scheduled, 1)) {
+        deque_push(&sites->injected, shard);
+        sem_post(&sites->ready);
+    }
+
+    emit_site_tasks(sites, out, sites->dispatched, 0);
+}
+
+/* Writes out the tasks' answers in dispatch order, up to the given task or, without waiting, the first not done */
+void emit_site_tasks(Sites *sites, OutputBuffer *out, long until, int wait) {
+    while (sites->emitted < until) {
+        SiteTask *task = &sites->tasks[sites->emitted % SITE_TASKS];
+        if (!atomic_load_explicit(&task->done, memory_order_acquire)) {
+            if (!wait) return;
+            while (sem_wait(&sites->completed) == -1) {
+                // Interrupted, wait again
+            }
+            continue;
+        }
+
+        write_bytes(out, task->output.bytes, task->output.used);
+        if (task->output.failed) write_line(out, "Memory allocation error");
+        task->output.used = 0;
+        task->output.failed = 0;
+        sites->emitted++;
+    }
+}
+
+/* Prints an error of the dispatcher's own, after the answers of the lines before it */
+void site_error(Sites *sites, OutputBuffer *out, const char *message) {
+    emit_site_tasks(sites, out, sites->dispatched, 1);
+    write_line(out, message);
+}
+
+int init_shard_deque(ShardDeque *deque) {
+    deque->slots = malloc(MAX_SITES * sizeof(*deque->slots));
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    return deque->slots != NULL;
+}
+
+/* Owner only */
+void deque_push(ShardDeque *deque, Shard *shard) {
+    long bottom = atomic_load(&deque->bottom);
+    atomic_store(&deque->slots[bottom % MAX_SITES], shard);
+    atomic_store(&deque->bottom, bottom + 1);
+}
+
+/* Owner only: takes the newest shard, racing the thieves for the last one */
+Shard *deque_take(ShardDeque *deque) {
+    long bottom = atomic_load(&deque->bottom) - 1;
+    atomic_store(&deque->bottom, bottom);
+    long top = atomic_load(&deque->top);
+
+    if (top > bottom) {
+        atomic_store(&deque->bottom, bottom + 1);
+        return NULL;
+    }
+    Shard *shard = atomic_load(&deque->slots[bottom % MAX_SITES]);
+    if (top == bottom) {
+        if (!atomic_compare_exchange_strong(&deque->top, &top, top + 1)) shard = NULL;
+        atomic_store(&deque->bottom, bottom + 1);
+    }
+    return shard;
+}
+
+/* Any thread: takes the oldest shard, or NULL if there is none or another thread got it first */
+Shard *deque_steal(ShardDeque *deque) {
+    long top = atomic_load(&deque->top);
+    long bottom = atomic_load(&deque->bottom);
+    if (top >= bottom) return NULL;
+
+    Shard *shard = atomic_load(&deque->slots[top % MAX_SITES]);
+    if (!atomic_compare_exchange_strong(&deque->top, &top, top + 1)) return NULL;
+    return shard;
+}
+
+void *site_worker(void *argument) {
+    SiteWorker *worker = argument;
+    Sites *sites = worker->sites;
+
+    while (1) {
+        while (sem_wait(&sites->ready) == -1) {
+            // Interrupted, wait again
+        }
+        if (atomic_load(&sites->stopping)) return NULL;
+
+        /* Each post stands for a shard on some deque, though a take can lose a race and retry */
+        Shard *shard;
+        while ((shard = take_shard(sites, worker)) == NULL) {
+            sched_yield();
+        }
+        run_shard(sites, worker, shard);
+    }
+}
+
+/* The worker's own shards first, then the dispatcher's, then the other workers' */
+Shard *take_shard(Sites *sites, SiteWorker *worker) {
+    Shard *shard = deque_take(&worker->deque);
+    if (shard == NULL) shard = deque_steal(&sites->injected);
+    for (int i = 1; shard == NULL && i < sites->worker_count; i++) {
+        shard = deque_steal(&sites->workers[(worker->id + i) % sites->worker_count].deque);
+    }
+    return shard;
+}
+
+/**
+ * Runs the shard's tasks in order, a quantum at a time. After a full
+ * quantum the shard goes back on the worker's deque, where others may
+ * steal it; once its queue is empty it is unscheduled, unless a task
+ * arrived meanwhile.
+ */
+void run_shard(Sites *sites, SiteWorker *worker, Shard *shard) {
+    while (1) {
+        SiteTask *task;
+        int ran = 0;
+        while (ran < SITE_QUANTUM && (task = ring_try_pop(&shard->tasks)) != NULL) {
+            run_site_task(sites, task);
+            atomic_fetch_sub(&shard->queued, 1);
+            ran++;
+        }
+        if (ran == SITE_QUANTUM) {
+            deque_push(&worker->deque, shard);
+            sem_post(&sites->ready);
+            return;
+        }
+
+        atomic_store(&shard->scheduled, 0);
+        if (atomic_load(&shard->queued) <= 0 || atomic_exchange(&shard->scheduled, 1)) return;
+    }
+}
+
+/* Runs a command on its site's system, keeping its answer for the dispatcher */
+void run_site_task(Sites *sites, SiteTask *task) {
+    VaccineSystem *system = &task->shard->system;
+    Command *command = &task->copy.command;
+
+    system->output.pending = &task->output;
+    if (command->error != NULL) {
+        write_line(&system->output, command->error);
+    }
+    run_command(system, command, sites->lang_pt);
+    flush_output(&system->output);
+    system->output.pending = NULL;
+
+    atomic_store_explicit(&task->done, 1, memory_order_release);
+    sem_post(&sites->completed);
+}
+
+/* Batches by expiration, then batch, then site */
+int compare_merged_batches(const void *first, const void *second) {
+    const MergedRecord *record1 = first, *record2 = second;
+    int order = compare_batches(record1->record, record2->record);
+    return order != 0 ? order : record1->shard->id - record2->shard->id;
+}
+
+/* Inoculations by date, then site, then log order */
+int compare_merged_inoculations(const void *first, const void *second) {
+    const MergedRecord *record1 = first, *record2 = second;
+    Date date1 = ((Inoculation *)record1->record)->application_date;
+    Date date2 = ((Inoculation *)record2->record)->application_date;
+    if (date1 != date2) return date1 < date2 ? -1 : 1;
+    if (record1->shard != record2->shard) return record1->shard->id - record2->shard->id;
+    return record1->position - record2->position;
+}
+
+/**
+ * The live batches of every site, or those of one vaccine, in one list
+ * order, or NULL if out of memory. The stores keep each field apart, so the
+ * records point to copies of the batches, which follow them in the block.
+ */
+MergedRecord *merge_batches(Sites *sites, const char *name, int *count) {
+    int total = 0;
+    for (int id = 0; id < sites->names.count; id++) {
+        VaccineSystem *system = &(*(Shard **)intern_entry(&sites->names, id))->system;
+        Vaccine *vaccine = name != NULL ? find_vaccine(system, name) : NULL;
+        total += name == NULL ? system->store.count : vaccine != NULL ? vaccine->batch_count : 0;
+    }
+    size_t records_size = (total > 0 ? total : 1) * sizeof(MergedRecord);
+    MergedRecord *merged = malloc(records_size + total * sizeof(VaccineBatch));
+    if (!merged) return NULL;
+    VaccineBatch *copies = (VaccineBatch *)((char *)merged + records_size);
+
+    *count = 0;
+    for (int id = 0; id < sites->names.count; id++) {
+        Shard *shard = *(Shard **)intern_entry(&sites->names, id);
+        BatchStore *store = &shard->system.store;
+        Vaccine *vaccine = name != NULL ? find_vaccine(&shard->system, name) : NULL;
+        int listed = name == NULL ? store->count : vaccine != NULL ? vaccine->batch_count : 0;
+        for (int i = 0; i < listed; i++) {
+            copies[*count] = load_batch(store, name == NULL ? store->order[i] : vaccine->batches[i]);
+            merged[*count] = (MergedRecord){&copies[*count], shard, i};
+            (*count)++;
+        }
+    }
+    qsort(merged, *count, sizeof(MergedRecord), compare_merged_batches);
+    return merged;
+}
+
+/* The live inoculations of every site, or of one patient, by date, or NULL if out of memory */
+MergedRecord *merge_inoculations(Sites *sites, const char *patient_name, int *count) {
+    int total = 0;
+    for (int id = 0; id < sites->names.count; id++) {
+        VaccineSystem *system = &(*(Shard **)intern_entry(&sites->names, id))->system;
+        Patient *patient = patient_name != NULL ? find_patient(system, patient_name) : NULL;
+        total += patient_name == NULL ? system->log.live : patient != NULL ? patient->count : 0;
+    }
+    MergedRecord *merged = malloc((total > 0 ? total : 1) * sizeof(MergedRecord));
+    if (!merged) return NULL;
+
+    *count = 0;
+    for (int id = 0; id < sites->names.count; id++) {
+        Shard *shard = *(Shard **)intern_entry(&sites->names, id);
+        VaccineSystem *system = &shard->system;
+        if (patient_name == NULL) {
+            for (int pos = 0; pos < system->log.size; pos++) {
+                Inoculation *inoculation = log_record(&system->log, pos);
+                if (!inoculation->deleted) merged[(*count)++] = (MergedRecord){inoculation, shard, pos};
+            }
+            continue;
+        }
+        Patient *patient = find_patient(system, patient_name);
+        for (int i = 0; patient != NULL && i < patient->count; i++) {
+            merged[(*count)++] = (MergedRecord){log_record(&system->log, patient->records[i]), shard, patient->records[i]};
+        }
+    }
+    qsort(merged, *count, sizeof(MergedRecord), compare_merged_inoculations);
+    return merged;
+}
+
+/* "@<site> ", before a line of a query over every site */
+void write_site(OutputBuffer *out, Sites *sites, Shard *shard) {
+    write_char(out, SITE_PREFIX);
+    write_string(out, sites->names.names[shard->id]);
+    write_char(out, ' ');
+}
+
+/**
+ * Lists the batches of every site, as l would if they were all in one
+ * system, each line starting with the batch's site
+ * Entry format: @* l [ <vaccine_name> { <vaccine_name> } ]
+ */
+void list_all_sites(Sites *sites, OutputBuffer *out, Command *command) {
+    /* Without names, a single pass over every batch */
+    for (int k = 0; k < (command->argc > 0 ? command->argc : 1); k++) {
+        char *token = command->argc > 0 ? command->args[k].text : NULL;
+        int count;
+        MergedRecord *merged = merge_batches(sites, token, &count);
+        if (merged == NULL) {
+            write_line(out, "Memory allocation error");
+            return;
+        }
+
+        for (int i = 0; i < count; i++) {
+            write_site(out, sites, merged[i].shard);
+            print_batch(out, merged[i].shard->system.vaccines.names, merged[i].record);
+        }
+        if (token != NULL && count == 0) {
+            write_error(out, token, sites->lang_pt ? ENOSUCHVACCINEPT : ENOSUCHVACCINE);
+        }
+        free(merged);
+    }
+}
+
+/**
+ * Lists the inoculations of every site, or of one patient across sites,
+ * by date, each line starting with the inoculation's site
+ * Entry format: @* u [ <patient_name> ]
+ */
+void inoculations_of_all_sites(Sites *sites, OutputBuffer *out, Command *command) {
+    const char *patient_name = command->argc == 1 ? command->args[0].text : NULL;
+    int count;
+    MergedRecord *merged = merge_inoculations(sites, patient_name, &count);
+    if (merged == NULL) {
+        write_line(out, "Memory allocation error");
+        return;
+    }
+
+    if (patient_name != NULL && count == 0) {
+        write_error(out, patient_name, sites->lang_pt ? ENOSUCHUSERPT : ENOSUCHUSER);
+    }
+    for (int i = 0; i < count; i++) {
+        write_site(out, sites, merged[i].shard);
+        print_inoculation(out, merged[i].shard->system.patients.names, merged[i].record);
+    }
+    free(merged);
+}
+
+/**
+ * Lists the batches every site retired in its last date change, merged in
+ * list order like @* l, each line starting with the batch's site
+ * Entry format: @* e
+ */
+void expired_of_all_sites(Sites *sites, OutputBuffer *out) {
+    int total = 0;
+    for (int id = 0; id < sites->names.count; id++) {
+        total += (*(Shard **)intern_entry(&sites->names, id))->system.expired.count;
+    }
+    MergedRecord *merged = malloc((total > 0 ? total : 1) * sizeof(MergedRecord));
+    if (!merged) {
+        write_line(out, "Memory allocation error");
+        return;
+    }
+
+    int count = 0;
+    for (int id = 0; id < sites->names.count; id++) {
+        Shard *shard = *(Shard **)intern_entry(&sites->names, id);
+        for (int i = 0; i < shard->system.expired.count; i++) {
+            merged[count++] = (MergedRecord){&shard->system.expired.batches[i], shard, i};
+        }
+    }
+    qsort(merged, count, sizeof(MergedRecord), compare_merged_batches);
+
+    for (int i = 0; i < count; i++) {
+        write_site(out, sites, merged[i].shard);
+        print_expired(out, merged[i].shard->system.vaccines.names, merged[i].record);
+    }
+    free(merged);
+}
+
+/* Stops the workers once every task is written out, then frees each site's system */
+void stop_sites(Sites *sites, int report_stats) {
+    atomic_store(&sites->stopping, 1);
+    for (int i = 0; i < sites->worker_count; i++) {
+        sem_post(&sites->ready);
+    }
+    for (int i = 0; i < sites->worker_count; i++) {
+        pthread_join(sites->workers[i].thread, NULL);
+        free(sites->workers[i].deque.slots);
+    }
+
+    for (int id = 0; id < sites->names.count; id++) {
+        Shard *shard = *(Shard **)intern_entry(&sites->names, id);
+        if (report_stats) {
+            fprintf(stderr, "%c%s\n", SITE_PREFIX, sites->names.names[id]);
+            report_stats_on_exit(&shard->system);
+        }
+        q(&shard->system);
+        free_ring(&shard->tasks);
+        free(shard);
+    }
+    for (int i = 0; i < SITE_TASKS; i++) {
+        free_command_copy(&sites->tasks[i].copy);
+        free(sites->tasks[i].output.bytes);
+    }
+    free(sites->tasks);
+    free(sites->injected.slots);
+    free_intern_table(&sites->names);
+    sem_destroy(&sites->ready);
+    sem_destroy(&sites->completed);
+}
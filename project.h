@@ -5,12 +5,84 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MAX_LINE_LENGTH 65535
 #define MAX_NAME_LENGTH 50
-#define MAX_VACCINE_LENGTH 100
-#define MAX_VACCINES 1000
+#define MAX_VACCINES 1000 // default limit of live batches
+#define MAX_BATCHES_OPTION "--max-batches=" // overrides MAX_VACCINES, 0 for no limit
 #define MAX_BATCH_LENGTH 20
+#define BATCH_KEY_HEAD_DIGITS 16 // digits packed in the first word of a batch key
+#define MAX_YEAR 5000000 // keeps day numbers within an int
+#define DAYS_PER_ERA 146097 // days in a 400-year Gregorian cycle
+#define EPOCH_DAY_NUMBER 719468 // days from 01-03-0000 to 01-01-1970
+#define INTERN_TABLE_INITIAL 1024 // initial number of slots and ids (power of two)
+#define VACCINE_HEAP_INITIAL 8
+#define VACCINE_BATCHES_INITIAL 8
+#define INOCULATION_CHUNK_SIZE 4096 // inoculation records per log chunk
+#define LOG_CHUNKS_INITIAL 16
+#define PATIENT_RECORDS_INITIAL 4
+#define NAME_ARENA_CHUNK 65536 // bytes per name arena chunk
+#define BATCH_STORE_INITIAL 64
+#define CACHE_LINE_SIZE 64 // alignment of the batch store's hot and cold arrays
+#define BATCH_INDEX_INITIAL 128 // initial number of buckets (power of two)
+#define INPUT_BLOCK_SIZE (1 << 20) // bytes read at a time, more than MAX_LINE_LENGTH
+#define COMMAND_ARGS_INITIAL 16
+#define OUTPUT_BUFFER_SIZE 65536 // bytes of output written at a time
+#define STATS_OPTION "--stats" // prints the stats on stderr at q
+#define COMMAND_LETTERS 26
+#define LATENCY_BUCKETS 40 // bucket i holds latencies under 2^i ns
+#define LATENCY_SAMPLE_EVERY 16 // time one run in every 16 of each command
+#define STATS_LINE_LENGTH 128
+#define RESTORE_OPTION "--restore=" // loads a snapshot written by w before reading commands
+#define SNAPSHOT_MAGIC "VACSNAP"
+#define SNAPSHOT_VERSION 1
+#define JOURNAL_OPTION "--journal=" // journals c, a, r, d and t, replaying it at startup
+#define JOURNAL_BUFFER_SIZE 1048576 // bytes of entries buffered between writes
+#define SNAPSHOT_PATH_LENGTH 4096
+#define PIPELINE_OPTION "--pipeline" // parses, runs and writes the commands on three threads
+#define PIPELINE_BATCHES 4 // command batches in flight between the parser and the executor
+#define PIPELINE_CHUNKS 4 // output chunks in flight between the executor and the writer
+#define RING_SPINS 1024 // looks at an empty or full ring before parking on it
+#define BATCH_COMMANDS 4096 // commands per batch at most
+#define READERS_OPTION "--readers=" // runs l and u on this many threads, implies --pipeline
+#define MAX_READERS 64
+#define READ_JOBS 8 // l and u commands in flight at most; more run on the executor
+#define READ_JOB_CHUNKS 4 // output chunks in flight between a reader and the writer
+#define LISTEN_OPTION "--listen=" // serves clients on a Unix socket path, or a localhost TCP port
+#define LISTEN_BACKLOG 64
+#define SERVER_EVENTS 64 // epoll events handled per wait
+#define CONNECTION_INPUT_INITIAL 4096
+#define CONNECTION_OUTPUT_LIMIT (1 << 22) // pending output above which a client is not read
+#define SITES_OPTION "--sites=" // runs "@<site> <command>" lines on per-site systems, on this many threads
+#define MAX_SITE_WORKERS 64
+#define MAX_SITES 1024 // sites at most, the default one included
+#define SITE_TASKS 4096 // commands dispatched to the sites and not yet written out, at most
+#define SHARD_TASKS 256 // commands queued for one site at most
+#define SITE_QUANTUM 64 // commands a worker runs for a site before giving others a turn
+#define DEFAULT_SITE "main" // site of the lines without a prefix
+#define SITE_PREFIX '@'
+#define ALL_SITES "*" // site of the queries over every site
 
 #define EINVALID "invalid input"
 #define EINVALIDPT "entrada inválida"
@@ -48,61 +120,713 @@
 #define ENOSUCHUSER "no such user"
 #define ENOSUCHUSERPT "utente inexistente" 
 
-#define LOGGING_ENABLED 0 // set to 1 to enable logging, 0 to disable
+#define ESNAPSHOT "cannot write snapshot"
+#define ESNAPSHOTPT "impossível escrever instantâneo"
 
+#define ERESTORE "cannot restore snapshot"
+#define ERESTOREPT "impossível restaurar instantâneo"
+
+#define EJOURNAL "journal failure"
+#define EJOURNALPT "falha no diário"
+
+#define ELISTEN "cannot listen"
+#define ELISTENPT "impossível escutar"
+
+#define ENOTALLOWED "not allowed"
+#define ENOTALLOWEDPT "não permitido"
+
+#define ETOOMANYSITES "too many sites"
+#define ETOOMANYSITESPT "demasiados locais"
+
+#define ESITESOPTION "cannot be combined with --journal, --restore, --pipeline, --readers or --listen"
+#define ESITESOPTIONPT "incompatível com --journal, --restore, --pipeline, --readers ou --listen"
+
+/* Tracepoints compile to nothing unless built with -DTRACING_ENABLED=1 */
+#ifndef TRACING_ENABLED
+#define TRACING_ENABLED 0
+#endif
+
+#if TRACING_ENABLED
+#define TRACE(message) fprintf(stderr, "[TRACE] %s\n", message)
+#else
+#define TRACE(message) ((void)0)
+#endif
+
+/* Day number (days since 01-01-1970): dates order and compare as integers */
+typedef int Date;
+
+/*
+ * Batch identifier packed four bits per hex digit, the first digit highest
+ * and the unused ones zero, then its length: keys compare as two words in
+ * the same order strcmp gives the identifiers, leading zeros included.
+ */
 typedef struct {
-    int day;
-    int month;
-    int year;
-} Date;
+    unsigned long long head; // First BATCH_KEY_HEAD_DIGITS digits
+    unsigned int tail;       // Remaining digits, then the length in the low byte
+} BatchKey;
 
 typedef struct {
-    char name[MAX_NAME_LENGTH + 1];
-    char batch[MAX_VACCINES + 1];
+    BatchKey batch;
+    int vaccine; // Id of the interned vaccine name
     Date expiration;
     int available_doses;
     int applied_doses;
 } VaccineBatch;
 
 typedef struct Inoculation {
-    char *user_name; // Dynamically allocated to handle varying name lengths
-    char batch[MAX_BATCH_LENGTH + 1];
-    char vaccine_name[MAX_NAME_LENGTH];
+    int patient; // Id of the interned patient name
+    int vaccine; // Id of the interned vaccine name
+    BatchKey batch;
+    atomic_int deleted; // Tombstone left by d until the log is compacted: the deletion's number
     Date application_date;
-    struct Inoculation *next; // Linked list for fast tracking
 } Inoculation;
 
+/* Append-only log of inoculations, in application order, stored in fixed-size chunks */
+typedef struct {
+    Inoculation **chunks;
+    int chunk_count;
+    int chunks_capacity;
+    int size; // Records appended, including deleted ones
+    int live; // Records not deleted
+} InoculationLog;
+
+/* Chunk of a bump allocator for names */
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char bytes[];
+} ArenaChunk;
+
 typedef struct {
-    VaccineBatch batches[MAX_VACCINES];
+    ArenaChunk *chunks; // Newest chunk first
+} NameArena;
+
+/* Open-addressing hash table interning names into dense ids, with an entry per id */
+typedef struct {
+    int *slots;            // Id + 1 of the name in each slot, 0 if empty
+    int capacity;
+    char **names;          // Interned name of each id
+    unsigned long *hashes; // Hash of each id's name
+    char *entries;         // Entry of each id, entry_size bytes apart
+    size_t entry_size;
+    int count;             // Ids handed out so far
+    int ids_capacity;
+    long lookups;          // Lookups and slots probed, for the stats
+    long probes;
+    NameArena arena;       // Bytes of the interned names
+} InternTable;
+
+typedef struct {
+    int *records; // Log positions of this patient's records, oldest first
+    int count;
+    int capacity;
+} Patient;
+
+/* Reference to a batch kept in its vaccine's heap */
+typedef struct {
+    BatchKey batch;
+    Date expiration;
+} BatchRef;
+
+typedef struct {
+    BatchRef *heap; // Min-heap of candidate batches by expiration, then batch
+    int heap_size;
+    int heap_capacity;
+    int *batches;   // Slots of the live batches with this name, in list order
     int batch_count;
+    int batch_capacity;
+} Vaccine;
+
+/* Open-addressing hash table from batch identifier to its slot in the store */
+typedef struct {
+    int *buckets; // -1 marks an empty bucket
+    int capacity;
+    int count;
+} BatchIndex;
+
+/* Fields of a stored batch that a, t and the ordering read: four to a cache line */
+typedef struct {
+    Date expiration;
+    int available_doses;
+    int applied_doses;
+    int vaccine;
+} HotBatch;
+
+/**
+ * Growable batch storage: batches never move, only their slot numbers do.
+ * The hot fields of each slot are apart from its key, which is only read
+ * to break ties, probe the index and print.
+ */
+typedef struct {
+    HotBatch *hot;         // Batch held in each slot
+    BatchKey *keys;        // Its identifier
+    int *order;            // Slots of the live batches by expiration, then batch
+    int *free_slots;       // Slots released by r, reused first
+    int count;             // Live batches
+    int free_count;
+    int slots_used;        // Slots handed out so far
+    int capacity;
+    int limit;             // Maximum number of live batches, 0 for no limit
+    BatchIndex index;
+    int *expiry;           // Min-heap of the slots of the unexpired batches, by expiration, then batch
+    int *expiry_pos;       // Position of each slot in the heap, -1 if not there
+    int expiry_count;
+} BatchStore;
+
+/* Batches that expired in the last t jump, with the doses they still had */
+typedef struct {
+    VaccineBatch *batches; // In list order
+    int count;
+    int capacity;
+} ExpiredBatches;
+
+/* Argument borrowed from the input buffer, terminated in place */
+typedef struct {
+    char *text;
+    int length;
+} Token;
+
+/* A command line, tokenized once before it reaches its handler */
+typedef struct {
+    char name;            // Command letter
+    Token *args;          // Batches and names in input order, owned by the reader
+    int argc;
+    int date_fields;      // How many of day, month and year were read
+    int day, month, year;
+    int quantity;         // Doses of c
+    const char *error;    // Message to print before running the command, if any
+    long long journal_offset; // Journal bytes of the commands before this one
+} Command;
+
+/* A command with its own copy of the arguments, to outlive the line it came from */
+typedef struct {
+    Command command;  // Arguments point into text
+    char *text;       // Each argument, NUL-terminated
+    size_t text_capacity;
+    Token *args;
+    int args_capacity;
+} CommandCopy;
+
+/* Write-ahead journal of the commands that change the system */
+typedef struct {
+    int fd;             // -1 when journaling is off
+    char *buffer;       // Entries not written yet, JOURNAL_BUFFER_SIZE bytes
+    size_t used;
+    long long offset;   // Journal bytes written so far
+    int dirty;          // Entries journaled since the last fsync
+    atomic_long entries; // Commands journaled and fsyncs, for the stats
+    atomic_long commits;
+} Journal;
+
+/**
+ * Single-producer single-consumer ring of pointers. Each index counts the
+ * items its own side moved, so tail - head are in the ring; a hand-off is
+ * a store to an index, with no system call. A side finding the ring empty
+ * or full spins a while, then parks on its semaphore, which the other
+ * side only posts when it sees the parked flag.
+ */
+typedef struct {
+    void **slots;
+    unsigned capacity;
+    int spins;                   // RING_SPINS, or 0 on one CPU, where the other side cannot run meanwhile
+    atomic_uint head;            // Items taken, moved by the consumer
+    char head_line[CACHE_LINE_SIZE - sizeof(atomic_uint)]; // Keeps the indices on their own lines
+    atomic_uint tail;            // Items put, moved by the producer
+    char tail_line[CACHE_LINE_SIZE - sizeof(atomic_uint)];
+    atomic_int consumer_parked;  // Set by a consumer about to sleep on filled
+    atomic_int producer_parked;  // Set by a producer about to sleep on free
+    sem_t filled;
+    sem_t free;
+} Ring;
+
+/* Block of output on its way to the writer thread */
+typedef struct {
+    char *bytes; // OUTPUT_BUFFER_SIZE bytes
+    size_t used;
+    struct ReadJob *job; // Reader whose output follows these bytes, if any
+} OutputChunk;
+
+/* Output held in memory until its owner passes it on, growing as needed */
+typedef struct {
+    char *bytes;
+    size_t sent;     // Bytes already passed on
+    size_t used;
+    size_t capacity;
+    int failed;      // Some output could not be stored
+} PendingOutput;
+
+/* A client of the server, with the input and output it has in flight */
+typedef struct Connection {
+    int fd;
+    int lang_pt;              // Language of its error messages, switched by "pt" and "en" lines
+    char *input;              // Bytes received, starting with the first unprocessed line
+    size_t input_used;
+    size_t input_capacity;
+    PendingOutput pending;    // Output the socket has not taken yet
+    int closing;              // After q or end of input: closed once the output is sent
+    int failed;               // Closed right away
+    unsigned events;          // What epoll is watching it for
+    struct Connection *prev;  // Open connections, for the shutdown
+    struct Connection *next;
+} Connection;
+
+/* Output of the commands, written to the stream in large blocks */
+typedef struct {
+    FILE *stream;     // NULL to discard the output
+    char *buffer;     // OUTPUT_BUFFER_SIZE bytes
+    size_t used;
+    Journal *journal; // Committed before any output is written
+    OutputChunk *chunk; // With a writer thread: the chunk being filled,
+    Ring *chunks;       // where it goes once full
+    Ring *free_chunks;  // and where the written ones come back
+    PendingOutput *pending; // Where flushes go instead, while a client's or site's command runs
+} OutputBuffer;
+
+/* Reads the input in large blocks and hands out its lines in place */
+typedef struct {
+    FILE *stream;
+    char *buffer;      // INPUT_BLOCK_SIZE bytes, plus a terminator
+    size_t start;      // First byte not handed out yet
+    size_t end;        // End of the bytes read
+    int eof;
+    Token *args;       // Argument storage shared by every command
+    int args_capacity;
+    OutputBuffer *output; // Flushed before blocking on a read, if any
+    Journal *journal;     // Where state-changing commands are journaled, if anywhere
+    int pause_before_read; // Return NULL once, with paused set, instead of blocking
+    int paused;
+} InputReader;
+
+/* A run of parsed commands, handed from the parser thread to the executor */
+typedef struct {
+    char *text;        // Copies of the command lines, which the arguments point into
+    size_t text_used;
+    Command *commands; // BATCH_COMMANDS commands
+    int *first_args;   // Where the arguments of each command start
+    int count;
+    Token *args;       // Arguments of every command, in order
+    int args_used;
+    int args_capacity;
+    int last;          // Nothing follows: the input ended or the last command is q
+} CommandBatch;
+
+/**
+ * An l or u without names handed to a reader thread, with what it needs of the system
+ * as of its position among the commands: l gets a copy of the live
+ * batches; u reads the log in place, up to its size then and skipping
+ * the records deleted before it, through its own copy of the chunk and
+ * name pointers. The log is not compacted while a reader is out.
+ */
+typedef struct ReadJob {
+    CommandCopy copy;
+    int lang_pt;
+    VaccineBatch *batches;    // l: the live batches in list order
+    int batches_capacity;
+    int batch_count;
+    Inoculation **chunks;     // u: the log's chunks
+    int chunks_capacity;
+    int size;                 // u: records in the log
+    int deletions;            // u: deletions before the command, still seen as live after it
+    char **patient_names;     // u: name of each patient id
+    int names_capacity;
+    char **vaccine_names;     // l: name of each vaccine id
+    int vaccine_names_capacity;
+    Ring output;              // Reader to writer, NULL ends the output
+    Ring free_output;         // Writer back to reader
+    OutputChunk chunk_pool[READ_JOB_CHUNKS];
+} ReadJob;
+
+/* Threads running l and u, each with its own ring of jobs */
+typedef struct {
+    int count;
+    pthread_t threads[MAX_READERS];
+    Ring jobs[MAX_READERS];   // Executor to each reader, NULL stops it
+    int next;                 // Reader given the next job
+    ReadJob job_pool[READ_JOBS];
+    Ring free_jobs;           // Writer back to executor, once a job's output is written
+    ReadJob *spare;           // Taken from free_jobs but not handed out
+    long started;             // Jobs handed out, and written, the latter by the writer
+    atomic_long finished;
+} ReaderPool;
+
+/* Parser, executor and writer threads, with the rings between them */
+typedef struct {
+    InputReader *reader;
+    Journal *journal;  // Committed before a batch leaves the parser, if any
+    FILE *stream;      // Where the writer writes
+    Ring batches;      // Parser to executor
+    Ring free_batches; // Executor back to parser
+    Ring chunks;       // Executor to writer, NULL stops the writer
+    Ring free_chunks;  // Writer back to executor
+    CommandBatch batch_pool[PIPELINE_BATCHES];
+    OutputChunk chunk_pool[PIPELINE_CHUNKS];
+    pthread_t parser;
+    pthread_t writer;
+    ReaderPool readers;
+} Pipeline;
+
+typedef struct {
+    long count;
+    long timed;    // Runs whose latency was measured
+    long total_ns;
+    long max_ns;
+    long buckets[LATENCY_BUCKETS];
+} CommandStats;
+
+/* Lengths of the scans over a kind of list */
+typedef struct {
+    long scans;
+    long visited;
+    long longest;
+} ScanStats;
+
+/* Always-on counters, printed by s and, with --stats, at q */
+typedef struct {
+    CommandStats commands[COMMAND_LETTERS]; // Indexed by command letter
+    long index_lookups;                     // Batch index lookups and buckets probed
+    long index_probes;
+    ScanStats batch_scans;                  // Batches visited by l for each name
+    ScanStats record_scans;                 // Inoculations visited by u and d
+} Stats;
+
+/* Event loop serving the clients, one command at a time */
+typedef struct {
+    int listen_fd;
+    int signal_fd;            // SIGINT and SIGTERM, which stop the server
+    int epoll_fd;
+    const char *socket_path;  // Removed on exit, NULL with TCP
+    InputReader *reader;      // Argument storage and journal for every client
+    int lang_pt;              // Language new clients start with
+    Connection *connections;
+} Server;
+
+/**
+ * Start of a snapshot file, followed by vaccine_count NUL-terminated vaccine
+ * names in id order (vaccine_name_bytes in all), batch_count VaccineBatch
+ * records in list order, patient_count NUL-terminated names (name_bytes in
+ * all), inoculation_count Inoculation records whose patient is an index into
+ * the names and expired_count VaccineBatch records reported by e.
+ */
+typedef struct {
+    char magic[8];
+    unsigned version;
+    unsigned batch_size;       // Record sizes of the build that wrote the file
+    unsigned inoculation_size;
     Date current_date;
-    Inoculation *inoculations;
+    unsigned vaccine_count;
+    unsigned vaccine_name_bytes;
+    unsigned batch_count;
+    unsigned patient_count;
+    unsigned inoculation_count;
+    unsigned name_bytes;
+    unsigned expired_count;
+    long long journal_offset;  // Journal bytes whose commands the snapshot includes
+} SnapshotHeader;
+
+typedef struct {
+    BatchStore store;
+    ExpiredBatches expired;
+    Date current_date;
+    InoculationLog log;
+    InternTable patients; // Patient of each interned patient name
+    InternTable vaccines; // Vaccine of each interned vaccine name
+    OutputBuffer output;
+    Stats stats;
+    Journal journal;
+    int deletions;        // Records deleted so far, each stamped with its number
+    ReaderPool *readers;  // Threads for l and u, if any
 } VaccineSystem;
 
+/**
+ * A site's own system, with the commands dispatched to it. A shard is
+ * scheduled, that is in some worker's hands or deque, at most once; the
+ * worker holding it runs its commands in order.
+ */
+typedef struct {
+    VaccineSystem system;
+    int id;               // Id of the site's name
+    Ring tasks;           // Dispatcher to the worker holding the shard
+    atomic_int queued;    // Tasks dispatched and not run yet
+    atomic_int scheduled;
+} Shard;
+
+/* A command dispatched to a site, with its output until it is written out in stream order */
+typedef struct {
+    Shard *shard;
+    CommandCopy copy;
+    PendingOutput output;
+    atomic_int done;
+} SiteTask;
+
+/**
+ * Chase-Lev work-stealing deque of shards: its owner pushes and takes at
+ * the bottom, other workers steal from the top. A shard is in one deque
+ * at most, so MAX_SITES slots are always enough.
+ */
+typedef struct {
+    _Atomic(Shard *) *slots;
+    atomic_long top;
+    atomic_long bottom;
+} ShardDeque;
+
+typedef struct {
+    pthread_t thread;
+    ShardDeque deque;    // Shards this worker rescheduled after a quantum
+    struct Sites *sites;
+    int id;
+} SiteWorker;
+
+/* Per-site shards, the workers running them and the window of dispatched commands */
+typedef struct Sites {
+    InternTable names;        // Shard of each site, by name
+    int max_batches;
+    int lang_pt;
+    ShardDeque injected;      // Shards scheduled by the dispatcher
+    SiteWorker workers[MAX_SITE_WORKERS];
+    int worker_count;
+    sem_t ready;              // One post per shard pushed onto a deque
+    sem_t completed;          // One post per task done
+    atomic_int stopping;
+    SiteTask *tasks;          // SITE_TASKS tasks, reused in dispatch order
+    long dispatched;
+    long emitted;             // Tasks whose output is written out
+} Sites;
+
+/* A batch or an inoculation of some site, for the queries over every site */
+typedef struct {
+    void *record;
+    Shard *shard;
+    int position; // In the site's own order
+} MergedRecord;
+
 /*============================= FUNCTIONS PROTOTYPES =============================*/
-void c(VaccineSystem *system, char *line, int lang_pt);
-void l(VaccineSystem *system, char *line, int lang_pt);
-void a(VaccineSystem *system, char *line, int lang_pt);
-void r(VaccineSystem *system, char *line, int lang_pt);
-void d(VaccineSystem *system, char *line, int lang_pt);
-void u(VaccineSystem *system, char *line, int lang_pt);
-void t(VaccineSystem *system, char *line, int lang_pt);
+void c(VaccineSystem *system, Command *command, int lang_pt);
+void l(VaccineSystem *system, Command *command, int lang_pt);
+void a(VaccineSystem *system, Command *command, int lang_pt);
+void r(VaccineSystem *system, Command *command, int lang_pt);
+void d(VaccineSystem *system, Command *command, int lang_pt);
+void u(VaccineSystem *system, Command *command, int lang_pt);
+void t(VaccineSystem *system, Command *command, int lang_pt);
+void w(VaccineSystem *system, Command *command, int lang_pt);
+void e(VaccineSystem *system, Command *command, int lang_pt);
 void q(VaccineSystem *system);
+void run_command(VaccineSystem *system, Command *command, int lang_pt);
+int init_vaccine_system(VaccineSystem *system, FILE *stream, int max_batches);
 
 /*----------------------------- AUXILIATY FUNCTIONS -------------------------------*/
-void log_message(const char *message);
 int valid_vaccine_name(const char *name);
-int is_valid_batch(const char *batch);
-int search_batch(VaccineSystem *system, char *batch);
-void insert_sorted(VaccineSystem *system, VaccineBatch new_batch);
-int find_earliest_valid_batch(VaccineSystem *system, char *vaccine_name);
+int search_batch(VaccineSystem *system, BatchKey batch);
+int insert_sorted(VaccineSystem *system, VaccineBatch *new_batch);
+void print_batch(OutputBuffer *out, char **vaccine_names, VaccineBatch *batch);
+void print_expired(OutputBuffer *out, char **vaccine_names, VaccineBatch *batch);
+int find_earliest_valid_batch(VaccineSystem *system, int vaccine_id);
 int is_valid_date(int day, int month, int year);
-int is_before_system_date(VaccineSystem *system, int day, int month, int year);
-int batch_exists(VaccineSystem *sys, char *batch);
-int parse_patient_name(char *line, char **patient_name, char **remainder);
-int is_already_vaccinated(VaccineSystem *system, const char *patient_name, const char *vaccine_name);
-void insert_sorted_inoculation(VaccineSystem *system, Inoculation *new_inoculation);
-void remove_inoculation(VaccineSystem *sys, Inoculation **prev, Inoculation **curent);
-int match_filters(Inoculation *inoculation, int args_parsed, int day, int month, int year, char *batch);
-
-#endif
\ No newline at end of file
+Date make_date(int day, int month, int year);
+void split_date(Date date, int *day, int *month, int *year);
+int is_valid_day_number(Date date);
+int is_before_system_date(VaccineSystem *system, Date date);
+int is_already_vaccinated(VaccineSystem *system, int patient_id, int vaccine_id);
+void remove_inoculation(VaccineSystem *sys, Inoculation *inoculation);
+int match_filters(Inoculation *inoculation, int has_date, Date date, const BatchKey *batch);
+void print_inoculation(OutputBuffer *out, char **patient_names, Inoculation *inoculation);
+
+/*----------------------------------- BATCH KEYS ----------------------------------*/
+int parse_batch_key(const char *text, int length, BatchKey *key);
+int is_valid_batch_key(BatchKey key);
+int compare_batch_keys(BatchKey key1, BatchKey key2);
+int same_batch_key(BatchKey key1, BatchKey key2);
+unsigned long hash_batch_key(BatchKey key);
+
+/*--------------------------------- INTERN TABLES ---------------------------------*/
+unsigned long hash_string(const char *str);
+int init_intern_table(InternTable *table, size_t entry_size);
+unsigned long intern_slot(InternTable *table, const char *name, unsigned long hash);
+int grow_intern_slots(InternTable *table);
+int grow_intern_ids(InternTable *table);
+int intern_lookup(InternTable *table, const char *name);
+int intern_name(InternTable *table, const char *name);
+void *intern_entry(InternTable *table, int id);
+void free_intern_table(InternTable *table);
+Patient *get_patient(VaccineSystem *system, int id);
+Patient *find_patient(VaccineSystem *system, const char *name);
+
+/*------------------------------------ VACCINES -----------------------------------*/
+int compare_batch_refs(BatchRef *ref1, BatchRef *ref2);
+int reserve_vaccine_heap(Vaccine *vaccine);
+int push_vaccine_batch(VaccineSystem *system, VaccineBatch *batch);
+void pop_vaccine_batch(Vaccine *vaccine);
+int dispensable_batch(VaccineSystem *system, int vaccine_id, BatchRef *ref);
+Vaccine *get_vaccine(VaccineSystem *system, int id);
+Vaccine *find_vaccine(VaccineSystem *system, const char *name);
+int vaccine_position(VaccineSystem *system, Vaccine *vaccine, int slot);
+int reserve_vaccine_batch(Vaccine *vaccine);
+void remove_vaccine_batch(VaccineSystem *system, int slot);
+void drop_expired_refs(VaccineSystem *system, Vaccine *vaccine);
+void free_vaccines(InternTable *table);
+
+/*---------------------------------- BATCH STORE ----------------------------------*/
+int init_batch_store(BatchStore *store, int limit);
+int batch_store_full(BatchStore *store);
+VaccineBatch load_batch(BatchStore *store, int slot);
+void store_batch(BatchStore *store, int slot, VaccineBatch *batch);
+int compare_slots(BatchStore *store, int slot1, int slot2);
+void *grow_aligned(void *array, size_t used, size_t size);
+int grow_batch_store(BatchStore *store);
+int alloc_batch_slot(BatchStore *store);
+int order_position(VaccineSystem *system, int slot);
+void remove_batch(VaccineSystem *system, int slot);
+void free_batch_store(BatchStore *store);
+unsigned long batch_bucket(VaccineSystem *system, BatchKey batch);
+int grow_batch_index(VaccineSystem *system);
+int index_batch(VaccineSystem *system, int slot);
+void unindex_batch(VaccineSystem *system, int slot);
+
+/*------------------------------------- EXPIRY ------------------------------------*/
+void place_expiry(BatchStore *store, int pos, int slot);
+void sift_expiry(VaccineSystem *system, int pos);
+void push_expiry(VaccineSystem *system, int slot);
+void remove_expiry(VaccineSystem *system, int slot);
+void expire_batches(VaccineSystem *system);
+int keep_expired(ExpiredBatches *expired, VaccineBatch *batch);
+
+/*------------------------------ INOCULATION STORAGE ------------------------------*/
+Inoculation *log_record(InoculationLog *log, int pos);
+int append_inoculation(VaccineSystem *system, Inoculation *inoculation);
+void find_date_records(VaccineSystem *system, Patient *patient, Date date, int *first, int *end);
+void compact_inoculation_log(VaccineSystem *system);
+void free_inoculation_log(InoculationLog *log);
+void free_patient_records(VaccineSystem *system);
+char *arena_strdup(NameArena *arena, const char *str);
+void free_name_arena(NameArena *arena);
+
+/*------------------------------------- INPUT -------------------------------------*/
+int init_input_reader(InputReader *reader, FILE *stream, OutputBuffer *output);
+char *next_line(InputReader *reader, size_t *length, int *has_newline);
+int read_command(InputReader *reader, Command *command);
+void parse_command(InputReader *reader, char *line, size_t length, int has_newline, Command *command);
+int tokenize_command(InputReader *reader, char *line, int has_newline, Command *command);
+int grow_command_args(InputReader *reader);
+Token next_word(char **cursor);
+int parse_patient_name(char **cursor, Token *patient_name, Command *command);
+void truncate_token(Token *token, int max_length);
+char *parse_number(char *text, int *value);
+int parse_date(char *text, Command *command);
+void free_input_reader(InputReader *reader);
+int copy_command(CommandCopy *copy, Command *command);
+void free_command_copy(CommandCopy *copy);
+
+/*------------------------------------- OUTPUT ------------------------------------*/
+int init_output_buffer(OutputBuffer *out, FILE *stream);
+void flush_output(OutputBuffer *out);
+void hand_output(OutputBuffer *out);
+void reserve_output(OutputBuffer *out, size_t size);
+void write_bytes(OutputBuffer *out, const char *bytes, size_t size);
+void write_string(OutputBuffer *out, const char *str);
+void write_char(OutputBuffer *out, char c);
+void write_line(OutputBuffer *out, const char *str);
+void write_error(OutputBuffer *out, const char *name, const char *message);
+void write_padded_int(OutputBuffer *out, int value, int width);
+void write_int(OutputBuffer *out, int value);
+void write_date(OutputBuffer *out, Date date);
+void write_batch_key(OutputBuffer *out, BatchKey key);
+void free_output_buffer(OutputBuffer *out);
+
+/*------------------------------------- STATS -------------------------------------*/
+long stats_clock(void);
+CommandStats *find_command_stats(Stats *stats, char name);
+long start_timing(CommandStats *command);
+void record_command(CommandStats *command, long start);
+void record_scan(ScanStats *scan, int length);
+long latency_percentile(CommandStats *command, int percent);
+void print_probes(OutputBuffer *out, const char *name, long lookups, long probes);
+void print_scans(OutputBuffer *out, const char *name, ScanStats *scan);
+void print_stats(Stats *stats, VaccineSystem *system, OutputBuffer *out);
+void report_stats_on_exit(VaccineSystem *system);
+
+/*------------------------------------ SNAPSHOT -----------------------------------*/
+int save_snapshot(VaccineSystem *system, const char *path, long long journal_offset);
+int is_valid_snapshot_batch(VaccineBatch *batch, unsigned vaccine_count);
+int load_snapshot(VaccineSystem *system, const char *path, long long *journal_offset);
+
+/*------------------------------------ JOURNAL ------------------------------------*/
+int is_journaled(const char *line);
+int open_journal(Journal *journal, const char *path, long long offset);
+void journal_failed(void);
+void write_journal(Journal *journal);
+void journal_command(Journal *journal, const char *line, size_t length);
+void commit_journal(Journal *journal);
+void close_journal(Journal *journal);
+long long replay_journal(VaccineSystem *system, const char *path, long long offset);
+
+/*------------------------------------ PIPELINE -----------------------------------*/
+int init_ring(Ring *ring, unsigned capacity);
+void ring_push(Ring *ring, void *item);
+void *ring_pop(Ring *ring);
+void *ring_try_pop(Ring *ring);
+void ring_wait(atomic_uint *index, unsigned value, int spins, atomic_int *parked, sem_t *wake);
+void ring_wake(atomic_int *parked, sem_t *wake);
+void free_ring(Ring *ring);
+int init_command_batch(CommandBatch *batch);
+void clear_command_batch(CommandBatch *batch);
+int keep_command_args(CommandBatch *batch, Command *command);
+void free_command_batch(CommandBatch *batch);
+int start_pipeline(Pipeline *pipeline, VaccineSystem *system, InputReader *reader, int reader_count);
+void *parser_thread(void *argument);
+CommandBatch *send_batch(Pipeline *pipeline, CommandBatch *batch, int last);
+int execute_batches(Pipeline *pipeline, VaccineSystem *system, int lang_pt);
+void *writer_thread(void *argument);
+void stop_pipeline(Pipeline *pipeline, VaccineSystem *system);
+
+/*------------------------------------- READERS -----------------------------------*/
+int start_readers(ReaderPool *readers, int count);
+int readers_out(ReaderPool *readers);
+int start_read(VaccineSystem *system, Command *command, int lang_pt);
+int copy_names(InternTable *table, char ***names, int *capacity);
+int snapshot_batches(VaccineSystem *system, ReadJob *job);
+int snapshot_log(VaccineSystem *system, ReadJob *job);
+void *reader_thread(void *argument);
+void run_read_job(ReadJob *job);
+void write_read_job(ReaderPool *readers, ReadJob *job, FILE *stream);
+void stop_readers(ReaderPool *readers);
+
+/*------------------------------------- SERVER ------------------------------------*/
+int serve(VaccineSystem *system, InputReader *reader, const char *address, int lang_pt);
+int open_listener(Server *server, const char *address);
+int watch_fd(Server *server, int fd, void *data);
+void accept_connections(Server *server);
+void watch_connection(Server *server, Connection *connection);
+void close_connection(Server *server, Connection *connection);
+void receive_input(Server *server, VaccineSystem *system, Connection *connection);
+void run_client_line(Server *server, VaccineSystem *system, Connection *connection,
+                     char *line, size_t length, int has_newline);
+void queue_output(PendingOutput *pending, const char *bytes, size_t size);
+void send_output(Connection *connection);
+void stop_server(Server *server);
+
+/*-------------------------------------- SITES ------------------------------------*/
+int start_sites(Sites *sites, int worker_count, int max_batches, int lang_pt);
+int run_sites(Sites *sites, InputReader *reader, OutputBuffer *out);
+Shard *find_shard(Sites *sites, const char *name);
+void dispatch_site_task(Sites *sites, OutputBuffer *out, Shard *shard, Command *command);
+void emit_site_tasks(Sites *sites, OutputBuffer *out, long until, int wait);
+void site_error(Sites *sites, OutputBuffer *out, const char *message);
+int init_shard_deque(ShardDeque *deque);
+void deque_push(ShardDeque *deque, Shard *shard);
+Shard *deque_take(ShardDeque *deque);
+Shard *deque_steal(ShardDeque *deque);
+void *site_worker(void *argument);
+Shard *take_shard(Sites *sites, SiteWorker *worker);
+void run_shard(Sites *sites, SiteWorker *worker, Shard *shard);
+void run_site_task(Sites *sites, SiteTask *task);
+int compare_merged_batches(const void *first, const void *second);
+int compare_merged_inoculations(const void *first, const void *second);
+MergedRecord *merge_batches(Sites *sites, const char *name, int *count);
+MergedRecord *merge_inoculations(Sites *sites, const char *patient_name, int *count);
+void write_site(OutputBuffer *out, Sites *sites, Shard *shard);
+void list_all_sites(Sites *sites, OutputBuffer *out, Command *command);
+void inoculations_of_all_sites(Sites *sites, OutputBuffer *out, Command *command);
+void expired_of_all_sites(Sites *sites, OutputBuffer *out);
+void stop_sites(Sites *sites, int report_stats);
+
+#endif
@@ -0,0 +1,306 @@
+/*================================ BENCHMARK HARNESS ===============================*/
+/*                                                                                  */
+/* Replays a workload against the program twice:                                    */
+/*  - a throughput pass, with the whole file on stdin and the output discarded;     */
+/*  - a latency pass, in lock-step over pipes, timing one command in every k.       */
+/*                                                                                  */
+/* A timed command is followed by a bare "t", which prints the system date once   */
+/* the command is done, so its latency is the round trip up to that date. Lines     */
+/* made only of a date are counted to know when the program has caught up; the      */
+/* workload's own t commands must be valid so each prints exactly one date.        */
+/*                                                                                  */
+/* Usage: harness [-e program] [-a argument]... [-x file] [-k every] <workload>     */
+/*   -a passes an argument to the program (repeatable)                              */
+/*   -x removes a file before each pass, e.g. the program's journal                 */
+/*==================================================================================*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define DEFAULT_PROGRAM "../proj"
+#define DEFAULT_EVERY 100
+#define READ_CHUNK 65536
+#define SAMPLES_INITIAL 1024
+#define DATE_LINE_LENGTH 10 // dd-mm-yyyy
+#define MAX_ARGUMENTS 16
+
+typedef struct {
+    double *values; // Latencies in microseconds
+    int count;
+    int capacity;
+} Samples;
+
+/* Both ends of the program being measured during the latency pass */
+typedef struct {
+    pid_t pid;
+    int input;             // Program's stdin
+    int output;            // Program's stdout
+    long dates_expected;   // Date lines the program owes for the t commands sent
+    long dates_seen;
+    char line[DATE_LINE_LENGTH + 1]; // Start of the output line being read
+    int line_length;
+} Program;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int add_sample(Samples *samples, double value) {
+    if (samples->count == samples->capacity) {
+        int capacity = samples->capacity ? samples->capacity * 2 : SAMPLES_INITIAL;
+        double *values = realloc(samples->values, capacity * sizeof(double));
+        if (!values) return 0;
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = value;
+    return 1;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted samples */
+double percentile(Samples *samples, double p) {
+    int rank = (int)(p / 100.0 * samples->count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > samples->count) rank = samples->count;
+    return samples->values[rank - 1];
+}
+
+int is_date_line(const char *line, int length) {
+    if (length != DATE_LINE_LENGTH || line[2] != '-' || line[5] != '-') return 0;
+    for (int i = 0; i < DATE_LINE_LENGTH; i++) {
+        if (i != 2 && i != 5 && !isdigit((unsigned char)line[i])) return 0;
+    }
+    return 1;
+}
+
+/* Reads whatever output is available, counting the lines made only of a date */
+int drain_output(Program *program) {
+    char buffer[READ_CHUNK];
+    ssize_t bytes = read(program->output, buffer, sizeof(buffer));
+    if (bytes == 0) return -1; // The program closed its output
+    if (bytes < 0) return errno == EINTR ? 0 : -1;
+
+    for (ssize_t i = 0; i < bytes; i++) {
+        if (buffer[i] == '\n') {
+            if (is_date_line(program->line, program->line_length)) program->dates_seen++;
+            program->line_length = 0;
+        } else if (program->line_length <= DATE_LINE_LENGTH) {
+            program->line[program->line_length++] = buffer[i];
+        }
+    }
+    return 1;
+}
+
+/* Writes all bytes to the program, reading its output meanwhile so neither side blocks */
+int send_bytes(Program *program, const char *bytes, size_t size) {
+    while (size > 0) {
+        struct pollfd fds[2] = { { program->input, POLLOUT, 0 }, { program->output, POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            if (drain_output(program) < 0) return 0;
+        }
+        if (fds[0].revents & (POLLERR | POLLHUP)) return 0;
+        if (fds[0].revents & POLLOUT) {
+            ssize_t written = write(program->input, bytes, size);
+            if (written < 0 && errno != EINTR && errno != EAGAIN) return 0;
+            if (written > 0) {
+                bytes += written;
+                size -= written;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Waits until every t sent so far has printed its date */
+int wait_for_dates(Program *program) {
+    while (program->dates_seen < program->dates_expected) {
+        if (drain_output(program) < 0) return 0;
+    }
+    return 1;
+}
+
+int send_line(Program *program, const char *line, size_t length) {
+    if (line[0] == 't') program->dates_expected++;
+    return send_bytes(program, line, length);
+}
+
+int send_probe(Program *program) {
+    return send_line(program, "t\n", 2);
+}
+
+/* Program to run: arguments[0] is its path, the list ends with NULL */
+typedef struct {
+    char *arguments[MAX_ARGUMENTS + 2];
+    int count;
+    const char *scratch; // File removed before each pass, if any
+} Command;
+
+pid_t spawn(Command *command, int input, int output, int unused) {
+    if (command->scratch != NULL) unlink(command->scratch);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(input, STDIN_FILENO);
+        dup2(output, STDOUT_FILENO);
+        if (unused >= 0) close(unused);
+        execv(command->arguments[0], command->arguments);
+        perror(command->arguments[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+/* Runs the whole workload from the file, returning the elapsed seconds */
+double throughput_pass(Command *command, const char *path) {
+    int input = open(path, O_RDONLY);
+    int output = open("/dev/null", O_WRONLY);
+    if (input < 0 || output < 0) return -1;
+
+    double start = now_seconds();
+    pid_t pid = spawn(command, input, output, -1);
+    int status;
+    waitpid(pid, &status, 0);
+    double elapsed = now_seconds() - start;
+
+    close(input);
+    close(output);
+    return pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? elapsed : -1;
+}
+
+/* Replays the workload in lock-step, timing one command in every `every` */
+int latency_pass(Command *command, FILE *workload, int every, Samples samples[128], long *commands) {
+    int to_program[2], from_program[2];
+    if (pipe(to_program) < 0 || pipe(from_program) < 0) return 0;
+
+    Program program = {0};
+    program.pid = spawn(command, to_program[0], from_program[1], to_program[1]);
+    close(to_program[0]);
+    close(from_program[1]);
+    program.input = to_program[1];
+    program.output = from_program[0];
+    if (program.pid < 0) return 0;
+    fcntl(program.input, F_SETFL, O_NONBLOCK); // Partial writes instead of blocking on a full pipe
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    int ok = 1;
+
+    for (*commands = 0; ok && (length = getline(&line, &line_capacity, workload)) > 0; (*commands)++) {
+        if (line[0] == 'q') break;
+
+        if (*commands % every != every - 1) {
+            ok = send_line(&program, line, length);
+            continue;
+        }
+
+        /* Let everything before this command finish, then time it alone */
+        ok = send_probe(&program) && wait_for_dates(&program);
+        double start = now_seconds();
+        ok = ok && send_line(&program, line, length) && send_probe(&program) && wait_for_dates(&program);
+        double elapsed = now_seconds() - start;
+        ok = ok && add_sample(&samples[(unsigned char)line[0] & 127], elapsed * 1e6);
+    }
+
+    ok = ok && send_bytes(&program, "q\n", 2);
+    close(program.input);
+    while (drain_output(&program) > 0) {
+    }
+    close(program.output);
+
+    int status;
+    waitpid(program.pid, &status, 0);
+    free(line);
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void print_report(const char *path, long commands, double seconds, Samples samples[128]) {
+    printf("%s: %ld commands in %.3f s, %.0f commands/s\n", path, commands, seconds, commands / seconds);
+    printf("  cmd  samples     p50 us     p90 us     p99 us   p99.9 us     max us\n");
+    for (int c = 0; c < 128; c++) {
+        Samples *s = &samples[c];
+        if (s->count == 0) continue;
+        qsort(s->values, s->count, sizeof(double), compare_doubles);
+        printf("  %c  %9d %10.1f %10.1f %10.1f %10.1f %10.1f\n", c, s->count,
+               percentile(s, 50), percentile(s, 90), percentile(s, 99), percentile(s, 99.9),
+               s->values[s->count - 1]);
+    }
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: harness [-e program] [-a argument]... [-x file] [-k every] <workload>\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    Command command = { { DEFAULT_PROGRAM }, 1, NULL };
+    const char *path = NULL;
+    int every = DEFAULT_EVERY;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+            path = argv[i];
+            continue;
+        }
+        if (i + 1 == argc) usage();
+        switch (argv[i][1]) {
+            case 'e': command.arguments[0] = argv[++i]; break;
+            case 'a':
+                if (command.count == MAX_ARGUMENTS + 1) usage();
+                command.arguments[command.count++] = argv[++i];
+                break;
+            case 'x': command.scratch = argv[++i]; break;
+            case 'k': every = atoi(argv[++i]); break;
+            default: usage();
+        }
+    }
+    if (path == NULL || every <= 0) usage();
+
+    signal(SIGPIPE, SIG_IGN); // A program that dies shows up as a failed write
+
+    double seconds = throughput_pass(&command, path);
+    if (seconds < 0) {
+        fprintf(stderr, "%s: throughput pass failed\n", path);
+        return 1;
+    }
+
+    FILE *workload = fopen(path, "r");
+    if (!workload) {
+        perror(path);
+        return 1;
+    }
+
+    Samples samples[128] = {{0}};
+    long commands;
+    if (!latency_pass(&command, workload, every, samples, &commands)) {
+        fprintf(stderr, "%s: latency pass failed\n", path);
+        return 1;
+    }
+    fclose(workload);
+
+    print_report(path, commands, seconds, samples);
+    for (int c = 0; c < 128; c++) free(samples[c].values);
+    if (command.scratch != NULL) unlink(command.scratch);
+    return 0;
+}
@@ -0,0 +1,284 @@
+/*================================ WORKLOAD GENERATOR ==============================*/
+/*                                                                                  */
+/* Writes a stream of valid commands for the vaccine management system to stdout.  */
+/* The mix of commands is chosen by name and patients are drawn from a Zipf-like    */
+/* distribution, so that a few of them hold most of the inoculations.              */
+/*                                                                                  */
+/* Usage: workload [-n commands] [-m mix] [-p patients] [-v vaccines]               */
+/*                 [-z skew] [-s seed]                                              */
+/*==================================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define DEFAULT_COMMANDS 1000000
+#define DEFAULT_PATIENTS 100000
+#define DEFAULT_VACCINES 50
+#define DEFAULT_SKEW 1.0
+#define INITIAL_BATCHES_PER_VACCINE 2
+#define MAX_TRACKED_BATCHES 4096 // most recent batches kept for r and d
+#define QUOTED_PATIENT_EVERY 10  // every n-th patient has a name with a space
+#define DAYS_PER_ERA 146097
+#define EPOCH_DAY_NUMBER 719468
+
+enum { CMD_C, CMD_A, CMD_L, CMD_U, CMD_D, CMD_R, CMD_T, CMD_COUNT };
+
+typedef struct {
+    const char *name;
+    int weights[CMD_COUNT]; // Relative weight of c, a, l, u, d, r and t
+} Mix;
+
+static const Mix mixes[] = {
+    /*               c   a   l   u   d   r   t */
+    { "ingest",  {  10, 85,  1,  2,  1,  0,  1 } },
+    { "listing", {   1, 20, 30, 45,  2,  1,  1 } },
+    { "delete",  {   2, 50,  0,  5, 40,  0,  3 } },
+    { "time",    {   5, 50,  2,  3,  0,  0, 40 } },
+    { "mixed",   {   3, 60,  5, 15, 10,  2,  5 } },
+};
+
+typedef struct {
+    const Mix *mix;
+    long commands;
+    int patients;
+    int vaccines;
+    double skew;
+    double *patient_cdf;         // Cumulative probability of each patient
+    int current_date;            // Day number of the system date
+    unsigned long next_batch;    // Batch identifiers are increasing hexadecimal numbers
+    unsigned long batches[MAX_TRACKED_BATCHES];
+    int batch_count;
+    unsigned long long rng;
+} Workload;
+
+/* xorshift64* generator, so runs are reproducible across platforms */
+unsigned long long next_random(Workload *w) {
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 2685821657736338717ULL;
+}
+
+/* One splitmix64 step, so that every seed starts its own stream; xorshift must not start at 0 */
+unsigned long long seed_random(unsigned long long seed) {
+    unsigned long long z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return z != 0 ? z : 88172645463325252ULL;
+}
+
+/* Uniform integer in [0, bound) */
+long random_below(Workload *w, long bound) {
+    return (long)(next_random(w) % (unsigned long long)bound);
+}
+
+double random_unit(Workload *w) {
+    return (next_random(w) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Patient weights fall as 1 / rank^skew; a skew of 0 is uniform */
+int init_patient_cdf(Workload *w) {
+    w->patient_cdf = malloc(w->patients * sizeof(double));
+    if (!w->patient_cdf) return 0;
+
+    double total = 0;
+    for (int i = 0; i < w->patients; i++) {
+        total += 1.0 / pow(i + 1, w->skew);
+        w->patient_cdf[i] = total;
+    }
+    for (int i = 0; i < w->patients; i++) {
+        w->patient_cdf[i] /= total;
+    }
+    return 1;
+}
+
+int random_patient(Workload *w) {
+    double u = random_unit(w);
+    int low = 0, high = w->patients - 1;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (w->patient_cdf[mid] < u) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+void print_patient(int patient) {
+    if (patient % QUOTED_PATIENT_EVERY == 0) printf("\"patient %d\"", patient);
+    else printf("patient%d", patient);
+}
+
+/* Same day numbers as the program (days since 01-01-1970) */
+void print_date(int date) {
+    int days = date + EPOCH_DAY_NUMBER;
+    int era = (days >= 0 ? days : days - DAYS_PER_ERA + 1) / DAYS_PER_ERA;
+    int day_of_era = days - era * DAYS_PER_ERA;
+    int year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int march_month = (5 * day_of_year + 2) / 153;
+    int day = day_of_year - (153 * march_month + 2) / 5 + 1;
+    int month = march_month < 10 ? march_month + 3 : march_month - 9;
+    int year = year_of_era + era * 400 + (month <= 2);
+    printf("%02d-%02d-%04d", day, month, year);
+}
+
+void track_batch(Workload *w, unsigned long batch) {
+    if (w->batch_count < MAX_TRACKED_BATCHES) {
+        w->batches[w->batch_count++] = batch;
+    } else {
+        w->batches[random_below(w, MAX_TRACKED_BATCHES)] = batch;
+    }
+}
+
+void emit_c(Workload *w, int vaccine) {
+    unsigned long batch = w->next_batch++;
+    printf("c %lX ", batch);
+    print_date(w->current_date + 30 + random_below(w, 3650));
+    printf(" %ld vaccine%d\n", 1000 + random_below(w, 100000), vaccine);
+    track_batch(w, batch);
+}
+
+void emit_a(Workload *w) {
+    printf("a ");
+    print_patient(random_patient(w));
+    printf(" vaccine%ld\n", random_below(w, w->vaccines));
+}
+
+/* Mostly a few names, sometimes every batch */
+void emit_l(Workload *w) {
+    if (random_below(w, 10) == 0) {
+        printf("l\n");
+        return;
+    }
+    printf("l");
+    for (long i = 1 + random_below(w, 3); i > 0; i--) {
+        printf(" vaccine%ld", random_below(w, w->vaccines + 1)); // One past the end does not exist
+    }
+    printf("\n");
+}
+
+/* Mostly a single patient, rarely the whole history */
+void emit_u(Workload *w) {
+    if (random_below(w, 1000) == 0) {
+        printf("u\n");
+        return;
+    }
+    printf("u ");
+    print_patient(random_patient(w));
+    printf("\n");
+}
+
+/* Deletions by patient, by date in the last week, or by date and batch */
+void emit_d(Workload *w) {
+    printf("d ");
+    print_patient(random_patient(w));
+
+    long kind = random_below(w, 3);
+    if (kind >= 1) {
+        printf(" ");
+        print_date(w->current_date - random_below(w, 7));
+    }
+    if (kind == 2 && w->batch_count > 0) {
+        printf(" %lX", w->batches[random_below(w, w->batch_count)]);
+    }
+    printf("\n");
+}
+
+void emit_r(Workload *w) {
+    if (w->batch_count == 0) return;
+    printf("r %lX\n", w->batches[random_below(w, w->batch_count)]);
+}
+
+/* Dates never go back, so every t is valid and prints exactly one date */
+void emit_t(Workload *w) {
+    w->current_date += random_below(w, 8);
+    printf("t ");
+    print_date(w->current_date);
+    printf("\n");
+}
+
+int pick_command(Workload *w) {
+    int total = 0;
+    for (int i = 0; i < CMD_COUNT; i++) total += w->mix->weights[i];
+
+    long pick = random_below(w, total);
+    for (int i = 0; i < CMD_COUNT; i++) {
+        pick -= w->mix->weights[i];
+        if (pick < 0) return i;
+    }
+    return CMD_A;
+}
+
+const Mix *find_mix(const char *name) {
+    for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+        if (strcmp(mixes[i].name, name) == 0) return &mixes[i];
+    }
+    return NULL;
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: workload [-n commands] [-m mix] [-p patients] [-v vaccines] [-z skew] [-s seed]\n");
+    fprintf(stderr, "mixes:");
+    for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) fprintf(stderr, " %s", mixes[i].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    Workload w = {0};
+    w.mix = &mixes[0];
+    w.commands = DEFAULT_COMMANDS;
+    w.patients = DEFAULT_PATIENTS;
+    w.vaccines = DEFAULT_VACCINES;
+    w.skew = DEFAULT_SKEW;
+    w.rng = 88172645463325252ULL;
+    w.current_date = 20089; // 01-01-2025, the program's initial date
+    w.next_batch = 0x1000;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 == argc) usage();
+        const char *value = argv[++i];
+        switch (argv[i - 1][0] == '-' ? argv[i - 1][1] : '\0') {
+            case 'n': w.commands = atol(value); break;
+            case 'm': if (!(w.mix = find_mix(value))) usage(); break;
+            case 'p': w.patients = atoi(value); break;
+            case 'v': w.vaccines = atoi(value); break;
+            case 'z': w.skew = atof(value); break;
+            case 's': w.rng = seed_random(strtoull(value, NULL, 10)); break;
+            default: usage();
+        }
+    }
+    if (w.patients <= 0 || w.vaccines <= 0 || w.commands < 0) usage();
+
+    if (!init_patient_cdf(&w)) {
+        fprintf(stderr, "Memory allocation error\n");
+        return 1;
+    }
+
+    /* Every vaccine starts with some stock so that a succeeds from the start */
+    long emitted = 0;
+    for (int v = 0; v < w.vaccines && emitted < w.commands; v++) {
+        for (int b = 0; b < INITIAL_BATCHES_PER_VACCINE && emitted < w.commands; b++, emitted++) {
+            emit_c(&w, v);
+        }
+    }
+
+    for (; emitted < w.commands; emitted++) {
+        switch (pick_command(&w)) {
+            case CMD_C: emit_c(&w, random_below(&w, w.vaccines)); break;
+            case CMD_A: emit_a(&w); break;
+            case CMD_L: emit_l(&w); break;
+            case CMD_U: emit_u(&w); break;
+            case CMD_D: emit_d(&w); break;
+            case CMD_R: if (w.batch_count > 0) emit_r(&w); else emit_a(&w); break;
+            case CMD_T: emit_t(&w); break;
+        }
+    }
+
+    printf("q\n");
+    free(w.patient_cdf);
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*==================================== CLIENT ======================================*/
+/*                                                                                  */
+/* Plays a script against the program's server over several connections to its    */
+/* Unix socket. Each script line is "<k> <line>": the line is sent on connection k  */
+/* (1 to MAX_CONNECTIONS) and its answers are printed as "<k> <answer>".            */
+/*                                                                                  */
+/* A line is followed by "u .sync", whose "no such user" error marks the end of     */
+/* the answers in either language, so the patient .sync must not exist. After q    */
+/* the connection is read until the server closes it, printed as "<k> closed".     */
+/*                                                                                  */
+/* Usage: client <socket> < script                                                  */
+/*==================================================================================*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_CONNECTIONS 8
+#define CONNECT_TRIES 100 // the server may still be starting
+#define CONNECT_WAIT_NS 50000000L
+#define SYNC_LINE "u .sync\n"
+#define SYNC_ANSWER ".sync: "
+
+typedef struct {
+    int fd;      // -1 until opened, and again once closed by q
+    FILE *input; // Answers of the server
+} Connection;
+
+int connect_socket(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) return -1;
+    strcpy(address.sun_path, path);
+
+    struct timespec wait = {0, CONNECT_WAIT_NS};
+    for (int try = 0; try < CONNECT_TRIES; try++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) return -1;
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) return fd;
+        close(fd);
+        nanosleep(&wait, NULL);
+    }
+    return -1;
+}
+
+int send_all(int fd, const char *bytes, size_t size) {
+    while (size > 0) {
+        ssize_t sent = write(fd, bytes, size);
+        if (sent <= 0) return 0;
+        bytes += sent;
+        size -= sent;
+    }
+    return 1;
+}
+
+/* Prints the answers of connection k up to its sync answer, or up to its end after q */
+int print_answers(Connection *connection, int k, int closing) {
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int synced = 0;
+
+    while ((length = getline(&line, &capacity, connection->input)) > 0) {
+        if (!closing && strstr(line, SYNC_ANSWER) == line) {
+            synced = 1;
+            break;
+        }
+        printf("%d %s%s", k, line, line[length - 1] == '\n' ? "" : "\n");
+    }
+    free(line);
+    if (closing) {
+        printf("%d closed\n", k);
+        fclose(connection->input);
+        connection->fd = -1;
+        return 1;
+    }
+    return synced;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: client <socket> < script\n");
+        return 2;
+    }
+    Connection connections[MAX_CONNECTIONS + 1];
+    for (int k = 0; k <= MAX_CONNECTIONS; k++) connections[k].fd = -1;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int status = 0;
+
+    while (status == 0 && (length = getline(&line, &capacity, stdin)) > 0) {
+        char *text;
+        long k = strtol(line, &text, 10);
+        if (k < 1 || k > MAX_CONNECTIONS || *text != ' ') {
+            fprintf(stderr, "client: bad script line: %s", line);
+            status = 2;
+            break;
+        }
+        text++;
+        if (line[length - 1] == '\n') line[--length] = '\0';
+
+        Connection *connection = &connections[k];
+        if (connection->fd == -1) {
+            connection->fd = connect_socket(argv[1]);
+            connection->input = connection->fd == -1 ? NULL : fdopen(connection->fd, "r");
+            if (connection->input == NULL) {
+                fprintf(stderr, "client: cannot connect to %s\n", argv[1]);
+                status = 1;
+                break;
+            }
+        }
+
+        int closing = strcmp(text, "q") == 0;
+        if (!send_all(connection->fd, text, line + length - text) || !send_all(connection->fd, "\n", 1) ||
+            (!closing && !send_all(connection->fd, SYNC_LINE, strlen(SYNC_LINE))) ||
+            !print_answers(connection, k, closing)) {
+            fprintf(stderr, "client: connection %ld lost\n", k);
+            status = 1;
+        }
+    }
+    free(line);
+    for (int k = 0; k <= MAX_CONNECTIONS; k++) {
+        if (connections[k].fd != -1) fclose(connections[k].input);
+    }
+    return status;
+}